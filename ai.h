@@ -1,6 +1,23 @@
+#include <stdint.h>
+
 #include "game.h"
 
+#ifndef MOVE_TIME_LIMIT
 #define MOVE_TIME_LIMIT 5
+#endif
+
+/**
+ * Scale of the scores returned by evaluate(): a score of EVALUATION_SCALE
+ * corresponds to roughly a 73% (1 / (1 + e^-1)) chance of winning.
+ */
+#define EVALUATION_SCALE 100
+
+/**
+ * Scale of the scores returned by get_move_prior(): a move whose prior is
+ * PRIOR_SCALE higher than another's is considered e times as likely to be
+ * the best.
+ */
+#define PRIOR_SCALE 4
 
 /**
  * Makes a deep copy of the game state.
@@ -10,6 +27,15 @@
  */
 Game *copy_game_state(Game *g);
 
+/**
+ * Copies the state of a game into another game without allocating memory,
+ * so that searches can reuse the same copies for many positions.
+ *
+ * @param dst Pointer to a copy of the same game, made by copy_game_state.
+ * @param src Pointer to the game structure to copy.
+ */
+void copy_game_state_into(Game *dst, Game *src);
+
 /**
  * Makes a deep copy of the move.
  *
@@ -36,6 +62,218 @@ Move **get_possible_moves(Game *g, int *num_moves);
  */
 void destroy_list_of_moves(Move **moves, int num_moves);
 
+/**
+ * Generates the moves a random playout chooses from in the current state.
+ * Games without a rollout policy return get_possible_moves(); others may
+ * return a smaller set of plausible moves (e.g. a forced win or block). The
+ * list is freed with destroy_list_of_moves.
+ *
+ * @param g Pointer to the game structure.
+ * @param num_moves Pointer to an integer to store the number of moves.
+ * @return Move** Array of candidate moves.
+ */
+Move **get_rollout_moves(Game *g, int *num_moves);
+
+/**
+ * Generates the legal moves of the current state that capture a piece, which
+ * a quiescence search keeps playing beyond the depth limit until the
+ * position is quiet. Games without captures return none. The list is freed
+ * with destroy_list_of_moves.
+ *
+ * @param g Pointer to the game structure.
+ * @param num_moves Pointer to an integer to store the number of moves.
+ * @return Move** Array of capturing moves.
+ */
+Move **get_capture_moves(Game *g, int *num_moves);
+
+/**
+ * Maps a move to a small integer identifier. Two moves share an identifier
+ * exactly when they are the same action (e.g. the same cell or column), so
+ * the identifier can be used to index per-move statistics tables.
+ *
+ * @param m Pointer to the move structure.
+ * @return int Identifier in the range [0, get_num_move_ids()).
+ */
+int get_move_id(Move *m);
+
+/**
+ * Returns the number of distinct move identifiers for the game.
+ *
+ * @return int Upper bound (exclusive) of the values returned by get_move_id.
+ */
+int get_num_move_ids();
+
+/**
+ * Computes a 64-bit Zobrist hash of the position, including the player to
+ * move. Equal positions always hash equally, also across runs.
+ *
+ * @param g Pointer to the game structure.
+ * @return uint64_t Hash of the position.
+ */
+uint64_t hash_game_state(Game *g);
+
+/**
+ * Returns the next number of the splitmix64 generator, advancing its state.
+ *
+ * @param state State of the generator.
+ * @return uint64_t Next number.
+ */
+static inline uint64_t splitmix64(uint64_t *state) {
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/**
+ * Fills Zobrist keys for hash_game_state() from a fixed seed, so that hashes
+ * are the same in every run, as the opening books need.
+ *
+ * @param keys Keys to fill.
+ * @param num_keys Number of keys.
+ * @param seed State of splitmix64(), advanced past the keys drawn.
+ */
+static inline void fill_hash_keys(uint64_t *keys, int num_keys,
+                                  uint64_t *seed) {
+    for (int i = 0; i < num_keys; i++) keys[i] = splitmix64(seed);
+}
+
+/**
+ * Hashes the position so that positions that a symmetry of the board maps
+ * onto each other (a reflection or rotation under which the rules are the
+ * same) hash equally: the hash is the smallest hash_game_state() of the
+ * symmetric positions. Games without symmetries return hash_game_state().
+ *
+ * @param g Pointer to the game structure.
+ * @param symmetry Filled with the symmetry mapping g to the position whose
+ * hash is returned, to map moves with transform_move_id().
+ * @return uint64_t Hash of the position.
+ */
+uint64_t hash_canonical_state(Game *g, int *symmetry);
+
+/**
+ * Maps a move identifier through a symmetry of the board, or through its
+ * inverse, to carry moves between a position and its canonical position.
+ *
+ * @param move_id Identifier of a move (see get_move_id).
+ * @param symmetry Symmetry given by hash_canonical_state().
+ * @param inverse Whether to map back from the canonical position.
+ * @return int Identifier of the same move in the other position.
+ */
+int transform_move_id(int move_id, int symmetry, bool inverse);
+
+/** Number of symmetries of a square board, its reflections and rotations. */
+#define SQUARE_SYMMETRIES 8
+
+/**
+ * Fills the cell that each symmetry of a square board maps each cell to,
+ * cells being numbered row by row. Bit 0 of a symmetry mirrors the columns,
+ * bit 1 the rows, and bit 2 then swaps rows and columns.
+ *
+ * @param cells Table of SQUARE_SYMMETRIES rows of size * size cells.
+ * @param size Number of rows and columns of the board.
+ */
+static inline void fill_square_symmetries(unsigned char *cells, int size) {
+    for (int s = 0; s < SQUARE_SYMMETRIES; s++) {
+        for (int i = 0; i < size * size; i++) {
+            int r = i / size, c = i % size;
+            if (s & 1) c = size - 1 - c;
+            if (s & 2) r = size - 1 - r;
+            cells[s * size * size + i] = s & 4 ? c * size + r : r * size + c;
+        }
+    }
+}
+
+/**
+ * Returns the symmetry of a square board that undoes another, as numbered
+ * by fill_square_symmetries(). Only the symmetries that swap rows and
+ * columns have another inverse.
+ *
+ * @param symmetry Symmetry to undo.
+ * @return int Inverse symmetry.
+ */
+static inline int invert_square_symmetry(int symmetry) {
+    if (!(symmetry & 4)) return symmetry;
+    return 4 | (symmetry & 1) << 1 | (symmetry & 2) >> 1;
+}
+
+/**
+ * Cheaply scores how promising a move looks, without playing it. Only
+ * differences between the scores of the moves of one position matter (see
+ * PRIOR_SCALE).
+ *
+ * @param g Pointer to the game structure.
+ * @param m Pointer to a legal move in g.
+ * @return int Prior score of the move; higher is more promising.
+ */
+int get_move_prior(Game *g, Move *m);
+
+/**
+ * Statically evaluates a position that is not over yet, without searching.
+ *
+ * @param g Pointer to the game structure.
+ * @return int Score from the point of view of the player to move; positive
+ * values favour that player (see EVALUATION_SCALE).
+ */
+int evaluate(Game *g);
+
+/**
+ * Threat-space search: looks for a win of the player to move by a sequence
+ * of threats, each of which leaves the other player only a few answers, so
+ * that wins much deeper than a full search reaches are found quickly. Games
+ * without such threats return 0.
+ *
+ * @param g Pointer to the game structure.
+ * @param threes Whether threats to win in two moves are tried as well as
+ * threats to win on the next move, which finds more wins but takes longer.
+ * @param max_length Longest line looked for, in moves of both players.
+ * @param time_limit_ms Time after which the search gives up, or 0 for none.
+ * @param line If not NULL, filled with the moves of the winning line for one
+ * set of answers, to be freed with destroy_move.
+ * @return int Number of moves of the winning line, ending with the winning
+ * move, or 0 if none was found.
+ */
+int find_forced_win(Game *g, bool threes, int max_length, int time_limit_ms,
+                    Move **line);
+
+/**
+ * Solves the position exactly, for games that can do so quickly from it
+ * (e.g. once few enough empty cells are left).
+ *
+ * @param g Pointer to the game structure.
+ * @param result Filled with the result of the game under perfect play.
+ * @param length Filled with the number of moves of both players until the
+ * end of the game, the winner winning as soon as possible and the loser
+ * losing as late as possible.
+ * @param nodes Filled with the number of positions searched.
+ * @return Move* A move keeping the result and length, or NULL if the
+ * position was not solved.
+ */
+Move *solve_position(Game *g, GameState *result, int *length,
+                     long long *nodes);
+
+/**
+ * Looks the position up in the endgame databases of the game, if it has
+ * them and they hold the position. Cheap enough to call at every node of a
+ * search.
+ *
+ * @param g Pointer to the game structure.
+ * @param result Filled with the result of the game under perfect play.
+ * @param length Filled with the number of moves of both players until the
+ * end of the game, as for solve_position().
+ * @return bool Whether the position was found.
+ */
+bool probe_endgame(Game *g, GameState *result, int *length);
+
+/**
+ * Writes a short description of a move, as the player would enter it.
+ *
+ * @param m Pointer to the move structure.
+ * @param str Buffer to write to.
+ * @param size Size of the buffer.
+ */
+void format_move(Move *m, char *str, int size);
+
 /**
  * Function for AI to make a move in the game.
  *
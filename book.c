@@ -0,0 +1,214 @@
+#include "book.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ai.h"
+#include "game.h"
+#ifdef BUILD_BOOK
+#include "minimax.h"
+#endif
+
+#ifndef BOOK_FILE
+#define BOOK_FILE "book.bin"
+#endif
+
+#define BOOK_MAGIC "BOOK"
+#define HEADER_SIZE 8
+
+static const BookEntry *book;
+static uint32_t book_size;
+static bool book_opened;
+
+/*
+ * Maps the book file into memory, the first time the book is looked at. A
+ * file whose size does not match its header is left unused.
+ */
+static void open_book() {
+    book_opened = true;
+    int fd = open(BOOK_FILE, O_RDONLY);
+    if (fd < 0) return;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size >= HEADER_SIZE) {
+        char *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (data != MAP_FAILED) {
+            uint32_t count;
+            memcpy(&count, data + 4, sizeof(count));
+            if (memcmp(data, BOOK_MAGIC, 4) == 0 &&
+                (size_t)st.st_size == HEADER_SIZE + count * sizeof(BookEntry)) {
+                book = (const BookEntry *)(data + HEADER_SIZE);
+                book_size = count;
+            } else {
+                munmap(data, st.st_size);
+            }
+        }
+    }
+
+    close(fd);
+}
+
+Move *book_lookup(Game *g, int *score) {
+    if (!book_opened) open_book();
+    if (book_size == 0) return NULL;
+
+    int symmetry;
+    uint64_t hash = hash_canonical_state(g, &symmetry);
+    uint32_t high = hash >> 32, low = (uint32_t)hash;
+
+    // First entry not below the hash
+    uint32_t first = 0, last = book_size;
+    while (first < last) {
+        uint32_t middle = first + (last - first) / 2;
+        if (book[middle].hash_high < high ||
+            (book[middle].hash_high == high && book[middle].hash_low < low))
+            first = middle + 1;
+        else
+            last = middle;
+    }
+    if (first == book_size || book[first].hash_high != high ||
+        book[first].hash_low != low)
+        return NULL;
+
+    // The move is only played if legal, in case of a hash collision
+    int num_moves = 0;
+    Move **moves = get_possible_moves(g, &num_moves);
+    int id = transform_move_id(book[first].move, symmetry, true);
+    Move *m = NULL;
+    for (int i = 0; i < num_moves && m == NULL; i++) {
+        if (get_move_id(moves[i]) == id)
+            m = copy_move(moves[i]);
+    }
+    destroy_list_of_moves(moves, num_moves);
+
+    if (m != NULL) *score = book[first].score;
+    return m;
+}
+
+#ifdef BUILD_BOOK
+/** Entries of the book being built, in the order they were searched. */
+static BookEntry *entries;
+static int num_entries, capacity;
+
+static uint64_t entry_hash(const BookEntry *entry) {
+    return (uint64_t)entry->hash_high << 32 | entry->hash_low;
+}
+
+static int compare_entries(const void *a, const void *b) {
+    uint64_t x = entry_hash((const BookEntry *)a);
+    uint64_t y = entry_hash((const BookEntry *)b);
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Returns the move id of the book move of a position, searching it the first
+ * time it or a symmetric position is reached.
+ */
+static int book_move(Game *g) {
+    int symmetry;
+    uint64_t hash = hash_canonical_state(g, &symmetry);
+    for (int i = 0; i < num_entries; i++) {
+        if (entry_hash(&entries[i]) == hash)
+            return transform_move_id(entries[i].move, symmetry, true);
+    }
+
+    int score;
+    Move *m = minimax_search(g, &score);
+    if (num_entries == capacity) {
+        capacity = capacity == 0 ? 256 : 2 * capacity;
+        entries = (BookEntry *)realloc(entries, sizeof(BookEntry) * capacity);
+    }
+    BookEntry *entry = &entries[num_entries++];
+    entry->hash_high = hash >> 32;
+    entry->hash_low = (uint32_t)hash;
+    int id = get_move_id(m);
+    entry->move = transform_move_id(id, symmetry, false);
+    entry->score = score < INT16_MIN   ? INT16_MIN
+                   : score > INT16_MAX ? INT16_MAX
+                                       : score;
+    destroy_move(m);
+
+    printf("Position %d: move %d, score %d\n", num_entries, id, entry->score);
+    return id;
+}
+
+/*
+ * Adds the positions of the next plies moves from g for the player side:
+ * only the book move of side is followed, and every plausible move of the
+ * other player.
+ */
+static void add_positions(Game *g, Player side, int plies) {
+    if (plies == 0 || is_game_over(g) != GAME_NOT_FINISHED) return;
+
+    int best = -1, num_moves = 0;
+    Move **moves;
+    if (g->player_turn == side) {
+        best = book_move(g);
+        moves = get_possible_moves(g, &num_moves);
+    } else {
+        moves = get_rollout_moves(g, &num_moves);
+    }
+
+    for (int i = 0; i < num_moves; i++) {
+        if (best >= 0 && get_move_id(moves[i]) != best) continue;
+
+        Game *child = copy_game_state(g);
+        if (make_move(child, moves[i]))
+            child->player_turn =
+                child->player_turn == PLAYER1 ? PLAYER2 : PLAYER1;
+        add_positions(child, side, plies - 1);
+        destroy_game(child);
+    }
+
+    destroy_list_of_moves(moves, num_moves);
+}
+
+/*
+ * Builds the book of the first plies moves (argument 1, by default
+ * BOOK_PLIES) for both players and either of them starting, each position
+ * searched with minimax, and writes it to a file (argument 2, by default
+ * BOOK_FILE).
+ */
+int main(int argc, char **argv) {
+    int plies = argc > 1 ? atoi(argv[1]) : BOOK_PLIES;
+    const char *path = argc > 2 ? argv[2] : BOOK_FILE;
+
+    // An older book must not answer for the positions being searched
+    book_opened = true;
+    init();
+
+    Game *g = (Game *)calloc(1, sizeof(Game));
+    init_game_state(g);
+    for (int start = 0; start < 2; start++) {
+        for (int side = 0; side < 2; side++) {
+            g->player_turn = start == 0 ? PLAYER1 : PLAYER2;
+            add_positions(g, side == 0 ? PLAYER1 : PLAYER2, plies);
+        }
+    }
+    destroy_game(g);
+
+    qsort(entries, num_entries, sizeof(BookEntry), compare_entries);
+
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        perror("Failed to open the book file");
+        exit(EXIT_FAILURE);
+    }
+    uint32_t count = num_entries;
+    fwrite(BOOK_MAGIC, 1, 4, file);
+    fwrite(&count, sizeof(count), 1, file);
+    fwrite(entries, sizeof(BookEntry), num_entries, file);
+    fclose(file);
+
+    printf("%d positions written to %s\n", num_entries, path);
+    free(entries);
+    end();
+
+    return 0;
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,43 @@
+#ifndef _BOOK_H
+#define _BOOK_H
+
+#include <stdint.h>
+
+#include "game.h"
+
+/**
+ * Number of moves from the start that the book builder covers by default.
+ * Positions where the player the book is built for moves get the move of a
+ * search; positions where the other player moves are followed for every
+ * move get_rollout_moves() returns.
+ */
+#ifndef BOOK_PLIES
+#define BOOK_PLIES 4
+#endif
+
+/**
+ * An opening book entry, shared by the positions that symmetries of the board
+ * map onto each other. A book file is the four bytes "BOOK", the number of
+ * entries as a uint32_t, then the entries sorted by hash, all in the byte
+ * order of the machine that built it, so that it is used as mapped.
+ */
+typedef struct BookEntry {
+    uint32_t hash_high; /** Upper half of the hash_canonical_state() hash. */
+    uint32_t hash_low;  /** Lower half of the hash. */
+    /** get_move_id() of the move to play in the canonical position. */
+    int16_t move;
+    int16_t score;      /** Score of the search, for the player to move. */
+} BookEntry;
+
+/**
+ * Looks the position up in the opening book BOOK_FILE, which is mapped into
+ * memory on first use and shared between the processes using it. Returns
+ * NULL when the file is missing or invalid.
+ *
+ * @param g Pointer to the game structure.
+ * @param score Filled with the score of the book move, if found.
+ * @return Move* Book move of the position, or NULL if it is not in the book.
+ */
+Move *book_lookup(Game *g, int *score);
+
+#endif
\ No newline at end of file
@@ -1,9 +1,21 @@
+#include <fcntl.h>
 #include <locale.h>
 #include <ncurses.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef BUILD_ENDGAME
+#include <pthread.h>
+#endif
+
+#include "ai.h"
 #include "game.h"
 
 #define PLAYER1_NAME_LINE 0
@@ -22,6 +34,33 @@
 #define PAWN "●"
 #define KING_SYMBOL "K"
 #define PAWN_COUNT 12
+#define DRAW_MOVE_LIMIT 80
+#define MAN_VALUE 100
+#define KING_VALUE 150
+#define ADVANCE_VALUE 3
+#define BACK_ROW_VALUE 10
+#define CENTRE_VALUE 10
+#define SQUARES 32
+#define MAN_SQUARES (SQUARES - 4)
+#define MAX_SLICES 64
+#define ENDGAME_MAGIC "EGDB"
+#define ENDGAME_HEADER_SIZE 8
+#define MAX_LENGTH 254
+
+/**
+ * Largest number of pieces of the endgame databases, which hold the result
+ * under perfect play of every position with at most this many pieces,
+ * leaving aside the draw after DRAW_MOVE_LIMIT quiet moves: probes of wins
+ * and losses that may not end before it are left to the search.
+ * checkers_endgame builds them into ENDGAME_FILE, of about 6.5 MB for 4
+ * pieces and 150 MB for 5, which the engines look positions up in.
+ */
+#ifndef ENDGAME_PIECES
+#define ENDGAME_PIECES 4
+#endif
+#if defined(BUILD_ENDGAME) && !defined(ENDGAME_FILE)
+#define ENDGAME_FILE "checkers.egdb"
+#endif
 
 typedef struct Pawn {
     int row;
@@ -38,6 +77,55 @@ typedef struct Move {
     int to_col;
 } Move;
 
+/**
+ * Additional game state kept in Game.extra1.
+ */
+typedef struct CheckersState {
+    /** Moves since the last capture or man move; the game is drawn once this
+     * reaches DRAW_MOVE_LIMIT. */
+    int quiet_moves;
+} CheckersState;
+
+/**
+ * Position of the endgame databases, seen from the player to move: the sets
+ * of dark squares, numbered from 0 to 31 row by row, of the men and kings of
+ * the player to move (index 0) and of the other player (index 1). When
+ * PLAYER2 is to move the board is turned half a turn, so that the men of the
+ * player to move always move towards square 0.
+ */
+typedef struct EndgamePosition {
+    uint32_t men[2];
+    uint32_t kings[2];
+} EndgamePosition;
+
+/**
+ * Slice of the endgame databases: the positions with given numbers of men
+ * and kings of the player to move (index 0) and of the other player.
+ */
+typedef struct EndgameSlice {
+    int men[2];
+    int kings[2];
+} EndgameSlice;
+
+/** binomials[n][k] ways of choosing k squares out of n. */
+static uint64_t binomials[SQUARES + 1][SQUARES + 1];
+/** Index of the first position of each slice. */
+static uint64_t slice_offsets[ENDGAME_PIECES + 1][ENDGAME_PIECES + 1]
+                            [ENDGAME_PIECES + 1][ENDGAME_PIECES + 1];
+/** Value of each position: 0 for a draw, or 1 + the number of moves of both
+ * players to the end of the game, a multi-jump counting as one, which is odd
+ * if the player to move wins and even if they lose. */
+static _Atomic uint8_t *endgame_values;
+/** Number of pieces of the databases in memory, 0 if none. */
+static int endgame_pieces;
+#ifdef ENDGAME_FILE
+/** Squares next to each square diagonally, and beyond them, or -1 off the
+ * board; directions 0 and 1 go towards square 0. */
+static int neighbours[SQUARES][4], jumps[SQUARES][4];
+/** Number of positions of the databases up to each number of pieces. */
+static uint64_t endgame_sizes[ENDGAME_PIECES + 1];
+#endif
+
 void setup_players(Game *g, bool single_player) {
     char input[11];
 
@@ -180,6 +268,8 @@ static void draw_border() {
 }
 
 void init() {
+    srand(time(NULL));
+
     reset_shell_mode();
 
     setlocale(LC_ALL, "");
@@ -209,15 +299,234 @@ void end() {
     endwin();
 }
 
+/* Square at a row and column, or -1 off the board. */
+static int square_at(int row, int col) {
+    if (row < 0 || row >= BOARD_SIZE || col < 0 || col >= BOARD_SIZE)
+        return -1;
+    return row * 4 + col / 2;
+}
+
+static int count_squares(uint32_t set) {
+    int n = 0;
+    for (; set; set &= set - 1) n++;
+    return n;
+}
+
+/* Rank of a set among the sets of as many squares, in colex order. */
+static uint64_t rank_squares(uint32_t set) {
+    uint64_t rank = 0;
+    int n = 0;
+    for (int square = 0; set != 0; square++, set >>= 1)
+        if (set & 1) rank += binomials[square][++n];
+    return rank;
+}
+
+/* Numbers the squares of a set among the squares not occupied. */
+static uint32_t squeeze_squares(uint32_t set, uint32_t occupied) {
+    uint32_t squeezed = 0;
+    for (int free = 0; set != 0; set >>= 1, occupied >>= 1) {
+        if (occupied & 1) continue;
+        if (set & 1) squeezed |= (uint32_t)1 << free;
+        free++;
+    }
+    return squeezed;
+}
+
+/* Index of a position in the databases. */
+static uint64_t endgame_index(EndgamePosition *p) {
+    int our_men = count_squares(p->men[0]);
+    int their_men = count_squares(p->men[1]);
+    int our_kings = count_squares(p->kings[0]);
+    int their_kings = count_squares(p->kings[1]);
+    uint32_t men = p->men[0] | p->men[1];
+    int free = SQUARES - our_men - their_men;
+
+    // Our men are never on the promotion row, squares 0 to 3, and the other
+    // player's men never on squares 28 to 31
+    uint64_t index = rank_squares(p->men[0] >> 4) *
+                         binomials[MAN_SQUARES][their_men] +
+                     rank_squares(p->men[1]);
+    index = index * binomials[free][our_kings] +
+            rank_squares(squeeze_squares(p->kings[0], men));
+    index = index * binomials[free - our_kings][their_kings] +
+            rank_squares(squeeze_squares(p->kings[1], men | p->kings[0]));
+
+    return slice_offsets[our_men][our_kings][their_men][their_kings] + index;
+}
+
+#ifdef ENDGAME_FILE
+/* Column of a square: the dark squares of even rows are on odd columns. */
+static int square_col(int square) {
+    return square % 4 * 2 + (square / 4 % 2 == 0 ? 1 : 0);
+}
+
+static uint64_t slice_size(EndgameSlice *slice) {
+    int free = SQUARES - slice->men[0] - slice->men[1];
+    return binomials[MAN_SQUARES][slice->men[0]] *
+           binomials[MAN_SQUARES][slice->men[1]] *
+           binomials[free][slice->kings[0]] *
+           binomials[free - slice->kings[0]][slice->kings[1]];
+}
+
+/*
+ * Lists the slices of the positions with a number of pieces, of which a
+ * number are men, each player having a piece at least. Returns the number
+ * of slices.
+ */
+static int list_slices(int pieces, int men, EndgameSlice *slices) {
+    int n = 0;
+    for (int our_men = 0; our_men <= men; our_men++) {
+        for (int our_kings = 0; our_kings <= pieces - men; our_kings++) {
+            EndgameSlice slice = {
+                .men = {our_men, men - our_men},
+                .kings = {our_kings, pieces - men - our_kings},
+            };
+            if (slice.men[0] + slice.kings[0] > 0 &&
+                slice.men[1] + slice.kings[1] > 0)
+                slices[n++] = slice;
+        }
+    }
+    return n;
+}
+
+static void init_endgame_tables() {
+    static bool initialized = false;
+    if (initialized) return;
+    initialized = true;
+
+    for (int n = 0; n <= SQUARES; n++) {
+        binomials[n][0] = 1;
+        for (int k = 1; k <= n; k++)
+            binomials[n][k] = binomials[n - 1][k - 1] + binomials[n - 1][k];
+    }
+
+    for (int square = 0; square < SQUARES; square++) {
+        for (int direction = 0; direction < 4; direction++) {
+            int row = square / 4, col = square_col(square);
+            int row_step = direction < 2 ? -1 : 1;
+            int col_step = direction % 2 == 0 ? -1 : 1;
+            neighbours[square][direction] =
+                square_at(row + row_step, col + col_step);
+            jumps[square][direction] =
+                square_at(row + 2 * row_step, col + 2 * col_step);
+        }
+    }
+
+    // By number of pieces, then of men, so that the positions reached by a
+    // move come earlier or have as many pieces and men
+    uint64_t offset = 0;
+    EndgameSlice slices[MAX_SLICES];
+    for (int pieces = 2; pieces <= ENDGAME_PIECES; pieces++) {
+        for (int men = 0; men <= pieces; men++) {
+            int num_slices = list_slices(pieces, men, slices);
+            for (int i = 0; i < num_slices; i++) {
+                EndgameSlice *s = &slices[i];
+                slice_offsets[s->men[0]][s->kings[0]][s->men[1]][s->kings[1]] =
+                    offset;
+                offset += slice_size(s);
+            }
+        }
+        endgame_sizes[pieces] = offset;
+    }
+}
+
+/*
+ * Maps the endgame databases into memory. A file whose size does not match
+ * its header is left unused.
+ */
+static void open_endgame() {
+    static bool initialized = false;
+    if (initialized) return;
+    initialized = true;
+
+    init_endgame_tables();
+    int fd = open(ENDGAME_FILE, O_RDONLY);
+    if (fd < 0) return;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size >= ENDGAME_HEADER_SIZE) {
+        char *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (data != MAP_FAILED) {
+            uint32_t pieces;
+            memcpy(&pieces, data + 4, sizeof(pieces));
+            if (memcmp(data, ENDGAME_MAGIC, 4) == 0 && pieces >= 2 &&
+                pieces <= ENDGAME_PIECES &&
+                (uint64_t)st.st_size ==
+                    ENDGAME_HEADER_SIZE + endgame_sizes[pieces]) {
+                endgame_values =
+                    (_Atomic uint8_t *)(data + ENDGAME_HEADER_SIZE);
+                endgame_pieces = pieces;
+            } else {
+                munmap(data, st.st_size);
+            }
+        }
+    }
+
+    close(fd);
+}
+#endif
+
 void init_game_state(Game *g) {
     Pawn *pawns = (Pawn *)malloc(sizeof(Pawn) * PAWN_COUNT * 2);
     init_pawns(pawns, pawns + PAWN_COUNT);
 
+    CheckersState *state = (CheckersState *)malloc(sizeof(CheckersState));
+    state->quiet_moves = 0;
+
     g->board = (void *)pawns;
     g->player_turn = PLAYER1;
     g->result = GAME_NOT_FINISHED;
-    g->extra1 = NULL;
+    g->extra1 = (void *)state;
     g->extra2 = NULL;
+
+#ifdef ENDGAME_FILE
+    open_endgame();
+#endif
+}
+
+Game *copy_game_state(Game *g) {
+    Game *copy = (Game *)malloc(sizeof(Game));
+    if (copy == NULL) {
+        perror("Failed to allocate memory for the game copy");
+        exit(EXIT_FAILURE);
+    }
+
+    strcpy(copy->player1, g->player1);
+    strcpy(copy->player2, g->player2);
+    copy->player_turn = g->player_turn;
+    copy->result = g->result;
+
+    Pawn *pawns = (Pawn *)malloc(sizeof(Pawn) * PAWN_COUNT * 2);
+    memcpy(pawns, g->board, sizeof(Pawn) * PAWN_COUNT * 2);
+    copy->board = (void *)pawns;
+
+    CheckersState *state = (CheckersState *)malloc(sizeof(CheckersState));
+    memcpy(state, g->extra1, sizeof(CheckersState));
+    copy->extra1 = (void *)state;
+    copy->extra2 = NULL;
+
+    return copy;
+}
+
+void copy_game_state_into(Game *dst, Game *src) {
+    dst->player_turn = src->player_turn;
+    dst->result = src->result;
+    memcpy(dst->board, src->board, sizeof(Pawn) * PAWN_COUNT * 2);
+    memcpy(dst->extra1, src->extra1, sizeof(CheckersState));
+}
+
+Move *copy_move(Move *m) {
+    if (!m) return NULL;
+
+    Move *copy = (Move *)malloc(sizeof(Move));
+    if (copy == NULL) {
+        perror("Failed to allocate memory for the move copy");
+        exit(EXIT_FAILURE);
+    }
+
+    *copy = *m;
+
+    return copy;
 }
 
 void display_result(Game *g) {
@@ -378,6 +687,12 @@ bool make_move(Game *g, Move *m) {
         }
     }
 
+    CheckersState *state = (CheckersState *)g->extra1;
+    if (selected_pawn->is_king && abs(m->to_row - m->from_row) == 1)
+        state->quiet_moves++;
+    else
+        state->quiet_moves = 0;
+
     // Move the pawn to the destination
     selected_pawn->row = m->to_row;
     selected_pawn->col = m->to_col;
@@ -518,6 +833,287 @@ void destroy_move(Move *m) {
 
 void destroy_game(Game *g) {
     free(g->board);
+    free(g->extra1);
+    free(g);
+}
+
+Move **get_possible_moves(Game *g, int *num_moves) {
+    Pawn *pawns = (Pawn *)g->board;
+    Pawn *player_pawns = pawns + (g->player_turn == PLAYER1 ? 0 : PAWN_COUNT);
+    Move **moves = (Move **)malloc(sizeof(Move *) * PAWN_COUNT * 8);
+    *num_moves = 0;
+
+    for (int i = 0; i < PAWN_COUNT; i++) {
+        if (player_pawns[i].is_captured) continue;
+
+        for (int row = -2; row <= 2; row++) {
+            for (int col = -2; col <= 2; col++) {
+                if (row == 0 || abs(row) != abs(col)) continue;
+
+                Move m = {
+                    .from_row = player_pawns[i].row,
+                    .from_col = player_pawns[i].col,
+                    .to_row = player_pawns[i].row + row,
+                    .to_col = player_pawns[i].col + col,
+                };
+
+                if (is_valid_move_private(g, &m, NULL))
+                    moves[(*num_moves)++] = copy_move(&m);
+            }
+        }
+    }
+
+    return moves;
+}
+
+Move **get_capture_moves(Game *g, int *num_moves) {
+    // Searched at every leaf, so each capture is checked on a grid of the
+    // pieces instead of with is_valid_move_private()
+    Pawn *pawns = (Pawn *)g->board;
+    // 0 for an empty square, 1 + the player of a piece
+    unsigned char grid[BOARD_SIZE][BOARD_SIZE] = {{0}};
+    for (int i = 0; i < PAWN_COUNT * 2; i++)
+        if (!pawns[i].is_captured)
+            grid[pawns[i].row][pawns[i].col] = 1 + pawns[i].player;
+
+    int opponent = 1 + (g->player_turn == PLAYER1 ? PLAYER2 : PLAYER1);
+    int forward = g->player_turn == PLAYER1 ? -1 : 1;
+    Pawn *player_pawns = pawns + (g->player_turn == PLAYER1 ? 0 : PAWN_COUNT);
+    Move **moves = NULL;
+    *num_moves = 0;
+
+    for (int i = 0; i < PAWN_COUNT; i++) {
+        if (player_pawns[i].is_captured) continue;
+
+        for (int row = -1; row <= 1; row += 2) {
+            if (!player_pawns[i].is_king && row != forward) continue;
+
+            for (int col = -1; col <= 1; col += 2) {
+                Move m = {
+                    .from_row = player_pawns[i].row,
+                    .from_col = player_pawns[i].col,
+                    .to_row = player_pawns[i].row + 2 * row,
+                    .to_col = player_pawns[i].col + 2 * col,
+                };
+                if (m.to_row < 0 || m.to_row >= BOARD_SIZE || m.to_col < 0 ||
+                    m.to_col >= BOARD_SIZE ||
+                    grid[m.from_row + row][m.from_col + col] != opponent ||
+                    grid[m.to_row][m.to_col] != 0)
+                    continue;
+
+                if (moves == NULL)
+                    moves = (Move **)malloc(sizeof(Move *) * PAWN_COUNT * 4);
+                moves[(*num_moves)++] = copy_move(&m);
+            }
+        }
+    }
+
+    return moves;
+}
+
+void destroy_list_of_moves(Move **moves, int num_moves) {
+    for (int i = 0; i < num_moves; i++) {
+        destroy_move(moves[i]);
+    }
+    free(moves);
+}
+
+Move **get_rollout_moves(Game *g, int *num_moves) {
+    return get_possible_moves(g, num_moves);
+}
+
+uint64_t hash_game_state(Game *g) {
+    static uint64_t keys[BOARD_SIZE * BOARD_SIZE][4];
+    static uint64_t quiet_keys[DRAW_MOVE_LIMIT + 1], turn_key;
+    static bool initialized = false;
+    if (!initialized) {
+        uint64_t seed = 8;
+        fill_hash_keys(&keys[0][0], BOARD_SIZE * BOARD_SIZE * 4, &seed);
+        fill_hash_keys(quiet_keys, DRAW_MOVE_LIMIT + 1, &seed);
+        fill_hash_keys(&turn_key, 1, &seed);
+        initialized = true;
+    }
+
+    Pawn *pawns = (Pawn *)g->board;
+    CheckersState *state = (CheckersState *)g->extra1;
+    uint64_t hash = g->player_turn == PLAYER2 ? turn_key : 0;
+
+    // The quiet move count is hashed too, so positions never repeat
+    hash ^= quiet_keys[state->quiet_moves];
+
+    for (int i = 0; i < PAWN_COUNT * 2; i++) {
+        if (pawns[i].is_captured) continue;
+
+        int kind = (pawns[i].player == PLAYER1 ? 0 : 2) + pawns[i].is_king;
+        hash ^= keys[pawns[i].row * BOARD_SIZE + pawns[i].col][kind];
+    }
+
+    return hash;
+}
+
+uint64_t hash_canonical_state(Game *g, int *symmetry) {
+    // Mirroring the board puts the pieces on the light squares
+    *symmetry = 0;
+    return hash_game_state(g);
+}
+
+int transform_move_id(int move_id, int symmetry, bool inverse) {
+    return move_id;
+}
+
+int get_move_id(Move *m) {
+    return ((m->from_row * BOARD_SIZE + m->from_col) * BOARD_SIZE +
+            m->to_row) *
+               BOARD_SIZE +
+           m->to_col;
+}
+
+int get_num_move_ids() {
+    return BOARD_SIZE * BOARD_SIZE * BOARD_SIZE * BOARD_SIZE;
+}
+
+int get_move_prior(Game *g, Move *m) {
+    // Captures first, then moves onto the promotion row
+    int promotion_row = g->player_turn == PLAYER1 ? 0 : BOARD_SIZE - 1;
+
+    return (abs(m->to_row - m->from_row) == 2 ? 2 : 0) +
+           (m->to_row == promotion_row ? 1 : 0);
+}
+
+/*
+ * Evaluates a position by material, men being worth more the further they
+ * have advanced towards promotion, except on their own back row, which they
+ * guard against the other player's men being crowned, and kings more in the
+ * centre, from where they reach most of the board.
+ */
+int evaluate(Game *g) {
+    Pawn *pawns = (Pawn *)g->board;
+    int score = 0;
+
+    for (int i = 0; i < PAWN_COUNT * 2; i++) {
+        if (pawns[i].is_captured) continue;
+
+        int value;
+        if (pawns[i].is_king) {
+            bool centre = pawns[i].row >= 2 && pawns[i].row < BOARD_SIZE - 2 &&
+                          pawns[i].col >= 2 && pawns[i].col < BOARD_SIZE - 2;
+            value = KING_VALUE + (centre ? CENTRE_VALUE : 0);
+        } else {
+            int advance = pawns[i].player == PLAYER1
+                              ? BOARD_SIZE - 1 - pawns[i].row
+                              : pawns[i].row;
+            value = MAN_VALUE + (advance == 0 ? BACK_ROW_VALUE
+                                              : advance * ADVANCE_VALUE);
+        }
+        score += pawns[i].player == g->player_turn ? value : -value;
+    }
+
+    return score;
+}
+
+int find_forced_win(Game *g, bool threes, int max_length, int time_limit_ms,
+                    Move **line) {
+    // Captures, the only moves that restrict the answers, are forced already
+    return 0;
+}
+
+/*
+ * Finds the position of the endgame databases of a game, turned half a turn
+ * when PLAYER2 is to move. Returns false if the databases do not hold it.
+ */
+static bool find_endgame_position(Game *g, EndgamePosition *p) {
+    if (endgame_pieces == 0) return false;
+
+    Pawn *pawns = (Pawn *)g->board;
+    int pieces = 0;
+    memset(p, 0, sizeof(*p));
+    for (int i = 0; i < PAWN_COUNT * 2; i++) {
+        if (pawns[i].is_captured) continue;
+        if (++pieces > endgame_pieces) return false;
+
+        int square = square_at(pawns[i].row, pawns[i].col);
+        if (g->player_turn == PLAYER2) square = SQUARES - 1 - square;
+        int side = pawns[i].player == g->player_turn ? 0 : 1;
+        if (pawns[i].is_king)
+            p->kings[side] |= (uint32_t)1 << square;
+        else
+            p->men[side] |= (uint32_t)1 << square;
+    }
+
+    return (p->men[0] | p->kings[0]) && (p->men[1] | p->kings[1]);
+}
+
+bool probe_endgame(Game *g, GameState *result, int *length) {
+    EndgamePosition p;
+    if (!find_endgame_position(g, &p)) return false;
+
+    int value = atomic_load_explicit(&endgame_values[endgame_index(&p)],
+                                     memory_order_relaxed);
+    *length = value > 0 ? value - 1 : 0;
+
+    // The databases ignore the draw after DRAW_MOVE_LIMIT quiet moves, so a
+    // win is only sure if it ends before the limit even if no move resets
+    // the count. A draw stays a draw, the limit only taking wins away.
+    int quiet_moves = ((CheckersState *)g->extra1)->quiet_moves;
+    if (value > 0 && quiet_moves + *length >= DRAW_MOVE_LIMIT) return false;
+
+    Player winner = *length % 2 == 1 ? g->player_turn
+                    : g->player_turn == PLAYER1 ? PLAYER2
+                                                : PLAYER1;
+    if (value == 0)
+        *result = GAME_DRAWN;
+    else
+        *result =
+            winner == PLAYER1 ? GAME_WON_BY_PLAYER1 : GAME_WON_BY_PLAYER2;
+
+    return true;
+}
+
+Move *solve_position(Game *g, GameState *result, int *length,
+                     long long *nodes) {
+    if (!probe_endgame(g, result, length)) return NULL;
+
+    // The move to the position of the databases that wins soonest, or
+    // draws, or loses latest. Children whose probe may not end before the
+    // draw limit are skipped, which never skips the best of them: its count
+    // is reset or one higher and it ends a move sooner.
+    GameState win = g->player_turn == PLAYER1 ? GAME_WON_BY_PLAYER1
+                                              : GAME_WON_BY_PLAYER2;
+    int num_moves = 0;
+    Move **moves = get_possible_moves(g, &num_moves);
+    Game *child = copy_game_state(g);
+    int best = -1, best_score = 0;
+    *nodes = 1;
+
+    for (int i = 0; i < num_moves; i++) {
+        copy_game_state_into(child, g);
+        bool done = make_move(child, moves[i]);
+        if (done)
+            child->player_turn =
+                child->player_turn == PLAYER1 ? PLAYER2 : PLAYER1;
+
+        GameState child_result = is_game_over(child);
+        int child_length = 0;
+        if (child_result == GAME_NOT_FINISHED &&
+            !probe_endgame(child, &child_result, &child_length))
+            continue;
+        (*nodes)++;
+
+        int moves_left = child_length + (done ? 1 : 0);
+        int score = child_result == GAME_DRAWN ? 0
+                    : child_result == win      ? MAX_LENGTH + 1 - moves_left
+                                               : moves_left - MAX_LENGTH - 1;
+        if (best < 0 || score > best_score) {
+            best = i;
+            best_score = score;
+        }
+    }
+
+    Move *m = best >= 0 ? copy_move(moves[best]) : NULL;
+    destroy_game(child);
+    destroy_list_of_moves(moves, num_moves);
+
+    return m;
 }
 
 void print_move(Game *g, Move *m) {
@@ -529,14 +1125,22 @@ void print_move(Game *g, Move *m) {
     refresh();
 }
 
+void format_move(Move *m, char *str, int size) {
+    snprintf(str, size, "%d,%d-%d,%d", m->from_row, m->from_col, m->to_row,
+             m->to_col);
+}
+
 void print(char *msg) {
     mvprintw(INPUT_ERROR_LINE, BOARD_COL_OFFSET, "%s", msg);
     refresh();
 }
 
-GameState is_game_over(Game *g) {
+static GameState evaluate_game_state(Game *g) {
     Player turn = g->player_turn;
 
+    if (((CheckersState *)g->extra1)->quiet_moves >= DRAW_MOVE_LIMIT)
+        return GAME_DRAWN;
+
     Pawn *pawns = (Pawn *)g->board;
     Pawn *player_pawns = pawns + (turn == PLAYER1 ? 0 : PAWN_COUNT);
 
@@ -617,3 +1221,424 @@ GameState is_game_over(Game *g) {
     // Game is won by the other player
     return turn == PLAYER1 ? GAME_WON_BY_PLAYER2 : GAME_WON_BY_PLAYER1;
 }
+
+GameState is_game_over(Game *g) {
+    GameState result = evaluate_game_state(g);
+    g->result = result;
+
+    return result;
+}
+
+#ifdef BUILD_ENDGAME
+/** remaining of a position that cannot be lost. */
+#define NEVER_LOST 255
+
+/**
+ * Share of one thread of a pass over the positions of a group of slices, of
+ * the same numbers of pieces and men, which the moves that neither capture
+ * nor crown lead to and back from.
+ */
+typedef struct EndgameTask {
+    EndgameSlice *slices;
+    int num_slices;
+    /** Index of the first position of the group. */
+    uint64_t group_offset;
+    /** Moves of each position of the group to positions of the group that
+     * are not known to win for the other player yet, or NEVER_LOST. */
+    _Atomic uint8_t *remaining;
+    /** For each position of the group, the length of its shortest win by a
+     * move out of the group, or if it may be lost, of its longest loss. */
+    uint8_t *out_lengths;
+    /** Number of moves to the end of the positions resolved by the pass, 0
+     * for the first. */
+    int length;
+    int thread;
+    int num_threads;
+    /** Filled with the number of positions resolved, and with the longest
+     * length of a position resolved or of a win out of the group. */
+    long long resolved;
+    int longest;
+} EndgameTask;
+
+/* Squares turned half a turn, square s becoming SQUARES - 1 - s. */
+static uint32_t reverse_squares(uint32_t set) {
+    set = (set >> 1 & 0x55555555) | (set & 0x55555555) << 1;
+    set = (set >> 2 & 0x33333333) | (set & 0x33333333) << 2;
+    set = (set >> 4 & 0x0F0F0F0F) | (set & 0x0F0F0F0F) << 4;
+    set = (set >> 8 & 0x00FF00FF) | (set & 0x00FF00FF) << 8;
+    return set >> 16 | set << 16;
+}
+
+/* Inverse of rank_squares(). */
+static uint32_t unrank_squares(uint64_t rank, int n) {
+    uint32_t set = 0;
+    for (int square = SQUARES - 1; n > 0; square--) {
+        if (binomials[square][n] <= rank) {
+            rank -= binomials[square][n];
+            set |= (uint32_t)1 << square;
+            n--;
+        }
+    }
+    return set;
+}
+
+/* Inverse of squeeze_squares(). */
+static uint32_t expand_squares(uint32_t squeezed, uint32_t occupied) {
+    uint32_t set = 0;
+    for (int square = 0, free = 0; square < SQUARES; square++) {
+        if (occupied >> square & 1) continue;
+        if (squeezed >> free & 1) set |= (uint32_t)1 << square;
+        free++;
+    }
+    return set;
+}
+
+/* Position at an index of a slice, or false if men of both overlap. */
+static bool endgame_position(EndgameSlice *slice, uint64_t index,
+                             EndgamePosition *p) {
+    int free = SQUARES - slice->men[0] - slice->men[1];
+    uint64_t size = binomials[free - slice->kings[0]][slice->kings[1]];
+    uint64_t their_kings = index % size;
+    index /= size;
+    size = binomials[free][slice->kings[0]];
+    uint64_t our_kings = index % size;
+    index /= size;
+    size = binomials[MAN_SQUARES][slice->men[1]];
+    p->men[0] = unrank_squares(index / size, slice->men[0]) << 4;
+    p->men[1] = unrank_squares(index % size, slice->men[1]);
+    if (p->men[0] & p->men[1]) return false;
+
+    uint32_t men = p->men[0] | p->men[1];
+    p->kings[0] =
+        expand_squares(unrank_squares(our_kings, slice->kings[0]), men);
+    p->kings[1] = expand_squares(
+        unrank_squares(their_kings, slice->kings[1]), men | p->kings[0]);
+    return true;
+}
+
+/* The same position seen from the other player. */
+static EndgamePosition endgame_flip(EndgamePosition *p) {
+    EndgamePosition flipped;
+    for (int side = 0; side < 2; side++) {
+        flipped.men[side] = reverse_squares(p->men[1 - side]);
+        flipped.kings[side] = reverse_squares(p->kings[1 - side]);
+    }
+    return flipped;
+}
+
+/* Whether our piece on a square can capture. */
+static bool can_capture(EndgamePosition *p, int square) {
+    uint32_t theirs = p->men[1] | p->kings[1];
+    uint32_t occupied = theirs | p->men[0] | p->kings[0];
+    bool king = p->kings[0] >> square & 1;
+    for (int direction = 0; direction < (king ? 4 : 2); direction++) {
+        int over = neighbours[square][direction];
+        int to = jumps[square][direction];
+        if (to >= 0 && theirs >> over & 1 && !(occupied >> to & 1))
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Stores the number of moves to the end of a position, unless another
+ * thread did already.
+ */
+static void resolve(EndgameTask *task, uint64_t index, int length) {
+    uint8_t unresolved = 0;
+    if (atomic_compare_exchange_strong_explicit(
+            &endgame_values[index], &unresolved, length + 1,
+            memory_order_relaxed, memory_order_relaxed)) {
+        task->resolved++;
+        if (length > task->longest) task->longest = length;
+    }
+}
+
+/*
+ * First pass over a position of the group: follows its moves as make_move()
+ * plays them, whose values are known already when they capture or crown,
+ * and counts the others.
+ */
+static void start_position(EndgameTask *task, EndgamePosition *p,
+                           uint64_t index) {
+    uint32_t ours = p->men[0] | p->kings[0];
+    uint32_t theirs = p->men[1] | p->kings[1];
+    uint32_t occupied = ours | theirs;
+    int num_moves = 0, in_group = 0, win = 0, loss = 0;
+    bool drawn = false;
+
+    for (int square = 0; square < SQUARES; square++) {
+        if (!(ours >> square & 1)) continue;
+
+        bool king = p->kings[0] >> square & 1;
+        for (int direction = 0; direction < (king ? 4 : 2); direction++) {
+            int to = neighbours[square][direction];
+            uint32_t captured = 0;
+            if (to >= 0 && theirs >> to & 1) {
+                captured = (uint32_t)1 << to;
+                to = jumps[square][direction];
+            }
+            if (to < 0 || occupied >> to & 1) continue;
+
+            num_moves++;
+            // Promoted on the first row
+            bool crowned = !king && to < 4;
+            if (!captured && !crowned) {
+                in_group++;
+                continue;
+            }
+
+            EndgamePosition child = *p;
+            uint32_t from_bit = (uint32_t)1 << square;
+            uint32_t to_bit = (uint32_t)1 << to;
+            if (king) {
+                child.kings[0] ^= from_bit | to_bit;
+            } else {
+                child.men[0] ^= from_bit;
+                if (crowned)
+                    child.kings[0] |= to_bit;
+                else
+                    child.men[0] |= to_bit;
+            }
+            child.men[1] &= ~captured;
+            child.kings[1] &= ~captured;
+
+            // The same player moves again after a capture if the piece can
+            // capture again, within the same move, and a player left without
+            // pieces has lost
+            bool again = captured && can_capture(&child, to);
+            int value = 1;
+            if (child.men[1] | child.kings[1]) {
+                if (!again) child = endgame_flip(&child);
+                value = atomic_load_explicit(
+                    &endgame_values[endgame_index(&child)],
+                    memory_order_relaxed);
+            }
+
+            int length = value - (again ? 1 : 0);
+            if (value == 0 || length > MAX_LENGTH)
+                drawn = true;
+            else if (length % 2 == 1)
+                win = win == 0 || length < win ? length : win;
+            else if (length > loss)
+                loss = length;
+        }
+    }
+
+    uint64_t i = index - task->group_offset;
+    if (num_moves == 0) {
+        resolve(task, index, 0);
+    } else if (win > 0 || drawn) {
+        task->out_lengths[i] = win;
+        if (win > task->longest) task->longest = win;
+    } else if (in_group == 0) {
+        resolve(task, index, loss);
+    } else {
+        atomic_store_explicit(&task->remaining[i], in_group,
+                              memory_order_relaxed);
+        task->out_lengths[i] = loss;
+    }
+}
+
+/*
+ * Resolves the positions of the group that lead by a move that neither
+ * captures nor crowns to a position resolved in the previous pass: with a
+ * win if it is lost, or with a loss if it is won and was the last of their
+ * moves not known to lose.
+ */
+static void resolve_predecessors(EndgameTask *task, EndgamePosition *p,
+                                 bool lost) {
+    // The other player made the move, their men towards square 31
+    uint32_t theirs = p->men[1] | p->kings[1];
+    uint32_t occupied = theirs | p->men[0] | p->kings[0];
+
+    for (int square = 0; square < SQUARES; square++) {
+        if (!(theirs >> square & 1)) continue;
+
+        bool king = p->kings[1] >> square & 1;
+        for (int direction = 0; direction < (king ? 4 : 2); direction++) {
+            int from = neighbours[square][direction];
+            if (from < 0 || occupied >> from & 1) continue;
+
+            EndgamePosition previous = *p;
+            uint32_t bits = (uint32_t)1 << square | (uint32_t)1 << from;
+            if (king)
+                previous.kings[1] ^= bits;
+            else
+                previous.men[1] ^= bits;
+            previous = endgame_flip(&previous);
+
+            uint64_t index = endgame_index(&previous);
+            uint64_t i = index - task->group_offset;
+            if (atomic_load_explicit(&endgame_values[index],
+                                     memory_order_relaxed) != 0)
+                continue;
+
+            if (lost) {
+                resolve(task, index, task->length);
+            } else if (atomic_load_explicit(&task->remaining[i],
+                                            memory_order_relaxed) !=
+                           NEVER_LOST &&
+                       atomic_fetch_sub_explicit(&task->remaining[i], 1,
+                                                 memory_order_relaxed) == 1) {
+                resolve(task, index,
+                        task->out_lengths[i] > task->length
+                            ? task->out_lengths[i]
+                            : task->length);
+            }
+        }
+    }
+}
+
+static void *solve_slices(void *arg) {
+    EndgameTask *task = (EndgameTask *)arg;
+    task->resolved = 0;
+    task->longest = 0;
+
+    for (int s = 0; s < task->num_slices; s++) {
+        EndgameSlice *slice = &task->slices[s];
+        uint64_t offset = slice_offsets[slice->men[0]][slice->kings[0]]
+                                       [slice->men[1]][slice->kings[1]];
+        uint64_t size = slice_size(slice);
+        uint64_t first = size * task->thread / task->num_threads;
+        uint64_t last = size * (task->thread + 1) / task->num_threads;
+
+        for (uint64_t index = offset + first; index < offset + last;
+             index++) {
+            uint64_t i = index - task->group_offset;
+            int value = atomic_load_explicit(&endgame_values[index],
+                                             memory_order_relaxed);
+            EndgamePosition p;
+            if (task->length == 0) {
+                if (endgame_position(slice, index - offset, &p))
+                    start_position(task, &p, index);
+            } else if (value == 0) {
+                // Won by a move out of the group in as many moves
+                if (task->out_lengths[i] == task->length &&
+                    atomic_load_explicit(&task->remaining[i],
+                                         memory_order_relaxed) == NEVER_LOST)
+                    resolve(task, index, task->length);
+            } else if (value == task->length) {
+                // Resolved in the previous pass, as value - 1 moves
+                endgame_position(slice, index - offset, &p);
+                resolve_predecessors(task, &p, value % 2 == 1);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Builds the endgame databases of up to a number of pieces (argument 1, by
+ * default ENDGAME_PIECES) with a number of threads (argument 2, by default
+ * one per online CPU), and writes them to a file (argument 3, by default
+ * ENDGAME_FILE). Each group of slices is solved backwards from the positions
+ * whose results the earlier groups and the end of the game give, one length
+ * at a time, each pass split between the threads.
+ */
+int main(int argc, char **argv) {
+    int pieces = argc > 1 ? atoi(argv[1]) : ENDGAME_PIECES;
+    int num_threads = argc > 2 ? atoi(argv[2]) : 0;
+    const char *path = argc > 3 ? argv[3] : ENDGAME_FILE;
+    if (pieces < 2 || pieces > ENDGAME_PIECES) {
+        fprintf(stderr, "Databases of 2 to %d pieces can be built\n",
+                ENDGAME_PIECES);
+        exit(EXIT_FAILURE);
+    }
+    if (num_threads <= 0) num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    init_endgame_tables();
+    uint64_t size = endgame_sizes[pieces];
+    endgame_values = (_Atomic uint8_t *)calloc(size, 1);
+    if (endgame_values == NULL) {
+        perror("Failed to allocate memory for the databases");
+        exit(EXIT_FAILURE);
+    }
+
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_t *threads = (pthread_t *)malloc(sizeof(pthread_t) * num_threads);
+    EndgameTask *tasks =
+        (EndgameTask *)malloc(sizeof(EndgameTask) * num_threads);
+    EndgameSlice slices[MAX_SLICES];
+    long long decided = 0;
+    int longest = 0;
+
+    for (int n = 2; n <= pieces; n++) {
+        for (int men = 0; men <= n; men++) {
+            int num_slices = list_slices(n, men, slices);
+            if (num_slices == 0) continue;
+
+            EndgameSlice *last = &slices[num_slices - 1];
+            uint64_t group_offset = slice_offsets[slices[0].men[0]]
+                                                 [slices[0].kings[0]]
+                                                 [slices[0].men[1]]
+                                                 [slices[0].kings[1]];
+            uint64_t group_size = slice_offsets[last->men[0]][last->kings[0]]
+                                               [last->men[1]][last->kings[1]] +
+                                  slice_size(last) - group_offset;
+            _Atomic uint8_t *remaining =
+                (_Atomic uint8_t *)malloc(group_size);
+            uint8_t *out_lengths = (uint8_t *)calloc(group_size, 1);
+            memset((void *)remaining, NEVER_LOST, group_size);
+
+            // Until no position is as long as a later pass would resolve
+            int group_longest = 0;
+            for (int length = 0;
+                 length <= group_longest + 1 && length <= MAX_LENGTH;
+                 length++) {
+                for (int t = 0; t < num_threads; t++) {
+                    tasks[t] = (EndgameTask){.slices = slices,
+                                             .num_slices = num_slices,
+                                             .group_offset = group_offset,
+                                             .remaining = remaining,
+                                             .out_lengths = out_lengths,
+                                             .length = length,
+                                             .thread = t,
+                                             .num_threads = num_threads};
+                    pthread_create(&threads[t], NULL, solve_slices,
+                                   &tasks[t]);
+                }
+                for (int t = 0; t < num_threads; t++) {
+                    pthread_join(threads[t], NULL);
+                    decided += tasks[t].resolved;
+                    if (tasks[t].longest > group_longest)
+                        group_longest = tasks[t].longest;
+                }
+            }
+            if (group_longest > longest) longest = group_longest;
+
+            free((void *)remaining);
+            free(out_lengths);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        printf("%d pieces: %llu entries, %lld won or lost, longest in %d "
+               "moves, %.1f s\n",
+               n, (unsigned long long)endgame_sizes[n], decided, longest,
+               (now.tv_sec - start.tv_sec) +
+                   (now.tv_nsec - start.tv_nsec) / 1e9);
+        fflush(stdout);
+    }
+    free(threads);
+    free(tasks);
+
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        perror("Failed to open the endgame file");
+        exit(EXIT_FAILURE);
+    }
+    uint32_t header = pieces;
+    fwrite(ENDGAME_MAGIC, 1, 4, file);
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite((void *)endgame_values, 1, size, file);
+    fclose(file);
+
+    printf("%d threads, %llu bytes written to %s\n", num_threads,
+           (unsigned long long)(ENDGAME_HEADER_SIZE + size), path);
+    free((void *)endgame_values);
+
+    return 0;
+}
+#endif
\ No newline at end of file
@@ -1,12 +1,33 @@
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+#include "ai.h"
 #include "game.h"
 
 #define ROWS 5
 #define COLUMNS 8
+#define THREAT_VALUE 20
+#define PARITY_VALUE 20
+#define STACKED_VALUE 60
+#define WINNING_VALUE 1000
+#define O_CODE 5
+#define CELLS (ROWS * COLUMNS)
+#define COLUMN_BITS (ROWS + 1)
+#define SOLVER_TABLE_BITS 22
+#define SCORE_OFFSET 64
+#define UPPER_BOUND 1
+#define LOWER_BOUND 2
+
+/**
+ * Positions with at most this many empty cells are solved exactly by
+ * solve_position. 0 never solves.
+ */
+#ifndef SOLVER_EMPTY_CELLS
+#define SOLVER_EMPTY_CELLS 24
+#endif
 
 typedef struct Move {
     int c;
@@ -70,6 +91,12 @@ Game *copy_game_state(Game *g) {
     return copy;
 }
 
+void copy_game_state_into(Game *dst, Game *src) {
+    dst->player_turn = src->player_turn;
+    dst->result = src->result;
+    memcpy(dst->board, src->board, ROWS * COLUMNS);
+}
+
 Move *copy_move(Move *m) {
     if (!m) return NULL;
 
@@ -162,6 +189,428 @@ void destroy_list_of_moves(Move **moves, int num_moves) {
     free(moves);
 }
 
+Move **get_rollout_moves(Game *g, int *num_moves) {
+    return get_possible_moves(g, num_moves);
+}
+
+Move **get_capture_moves(Game *g, int *num_moves) {
+    // Nothing is captured in connect 4
+    *num_moves = 0;
+    return NULL;
+}
+
+/** Zobrist keys of X and O on each cell, and of O to move. */
+static uint64_t hash_keys[CELLS][2], turn_key;
+
+/*
+ * Sets up the Zobrist keys the first time a position is hashed.
+ */
+static void init_hash_keys() {
+    static bool initialized = false;
+    if (initialized) return;
+    initialized = true;
+
+    uint64_t seed = 4;
+    fill_hash_keys(&hash_keys[0][0], CELLS * 2, &seed);
+    fill_hash_keys(&turn_key, 1, &seed);
+}
+
+uint64_t hash_game_state(Game *g) {
+    init_hash_keys();
+
+    char *board = (char *)g->board;
+    uint64_t hash = g->player_turn == PLAYER2 ? turn_key : 0;
+
+    for (int i = 0; i < CELLS; i++) {
+        if (board[i] != '.') hash ^= hash_keys[i][board[i] == 'X' ? 0 : 1];
+    }
+
+    return hash;
+}
+
+uint64_t hash_canonical_state(Game *g, int *symmetry) {
+    init_hash_keys();
+
+    // Symmetry 1 mirrors the columns, and is hashed in the same pass
+    char *board = (char *)g->board;
+    uint64_t hash = 0, mirrored = 0;
+    for (int i = 0; i < CELLS; i++) {
+        if (board[i] == '.') continue;
+
+        int p = board[i] == 'X' ? 0 : 1;
+        int mirror = i - i % COLUMNS + COLUMNS - 1 - i % COLUMNS;
+        hash ^= hash_keys[i][p];
+        mirrored ^= hash_keys[mirror][p];
+    }
+
+    *symmetry = mirrored < hash;
+    return (*symmetry ? mirrored : hash) ^
+           (g->player_turn == PLAYER2 ? turn_key : 0);
+}
+
+int transform_move_id(int move_id, int symmetry, bool inverse) {
+    // The mirror is its own inverse
+    return symmetry ? COLUMNS - 1 - move_id : move_id;
+}
+
+int get_move_id(Move *m) {
+    return m->c - 1;
+}
+
+int get_num_move_ids() {
+    return COLUMNS;
+}
+
+/*
+ * Scores a window of four cells for X, by how many of them a player holds if
+ * the other holds none. A window in which a player holds three cells marks
+ * the empty one as a threat of that player instead (0 for X, 1 for O), so
+ * that a cell completing several lines is counted once. Cells are coded so
+ * that the sum of the codes of a window tells how many cells each holds.
+ */
+static int score_window(char *codes, int index, int step, uint64_t threats[2]) {
+    static const int values[4 * O_CODE + 1] = {
+        [1] = 1, [2] = 4, [O_CODE] = -1, [2 * O_CODE] = -4};
+    int sum = codes[index] + codes[index + step] + codes[index + 2 * step] +
+              codes[index + 3 * step];
+
+    if (sum == 3 || sum == 3 * O_CODE) {
+        int empty = index;
+        while (codes[empty] != 0) empty += step;
+        threats[sum == 3 ? 0 : 1] |= (uint64_t)1 << empty;
+    }
+
+    return values[sum];
+}
+
+int get_move_prior(Game *g, Move *m) {
+    // Central columns take part in more lines
+    return COLUMNS - abs(2 * (m->c - 1) - (COLUMNS - 1));
+}
+
+/*
+ * Evaluates a position by the lines still open to each player and above all
+ * by their threats, the empty cells that would complete four. A playable
+ * threat of the player to move wins, as do two playable threats of the
+ * other player. Otherwise threats count more on the rows their owner tends
+ * to be left to fill as the columns fill up, and more again when the cell
+ * above is a threat of the same player, as blocking the lower one then
+ * loses to the upper one. With columns of an odd number of rows, those are
+ * the even rows from the bottom for the player who moved first, and the odd
+ * ones for the other, the opposite of the usual rule on six rows.
+ */
+int evaluate(Game *g) {
+    char *board = (char *)g->board;
+    char codes[ROWS * COLUMNS];
+    uint64_t threats[2] = {0, 0};
+    int score = 0, stones = 0;
+
+    for (int i = 0; i < ROWS * COLUMNS; i++) {
+        codes[i] = board[i] == 'X' ? 1 : board[i] == 'O' ? O_CODE : 0;
+        if (board[i] != '.') stones++;
+    }
+
+    for (int i = 0; i < ROWS; i++) {
+        for (int j = 0; j < COLUMNS; j++) {
+            if (j <= COLUMNS - 4)
+                score += score_window(codes, i * COLUMNS + j, 1, threats);
+            if (i <= ROWS - 4)
+                score +=
+                    score_window(codes, i * COLUMNS + j, COLUMNS, threats);
+            if (i <= ROWS - 4 && j <= COLUMNS - 4)
+                score += score_window(codes, i * COLUMNS + j, COLUMNS + 1,
+                                      threats);
+            if (i <= ROWS - 4 && j >= 3)
+                score += score_window(codes, i * COLUMNS + j, COLUMNS - 1,
+                                      threats);
+        }
+    }
+
+    int own = g->player_turn == PLAYER1 ? 0 : 1;
+    int first = stones % 2 == 0 ? own : 1 - own;
+
+    // Lowest empty cell of each column
+    uint64_t playable = 0;
+    for (int j = 0; j < COLUMNS; j++) {
+        int i = ROWS - 1;
+        while (i >= 0 && board[i * COLUMNS + j] != '.') i--;
+        if (i >= 0) playable |= (uint64_t)1 << (i * COLUMNS + j);
+    }
+
+    if (threats[own] & playable) return WINNING_VALUE;
+    uint64_t blocks = threats[1 - own] & playable;
+    if (blocks & (blocks - 1)) return -WINNING_VALUE;
+
+    for (int cell = 0; cell < ROWS * COLUMNS; cell++) {
+        for (int p = 0; p < 2; p++) {
+            if (!(threats[p] >> cell & 1)) continue;
+
+            int value = THREAT_VALUE;
+            if ((ROWS - cell / COLUMNS) % 2 == (p == first ? 0 : 1))
+                value += PARITY_VALUE;
+            if (cell >= COLUMNS && threats[p] >> (cell - COLUMNS) & 1)
+                value += STACKED_VALUE;
+            score += p == 0 ? value : -value;
+        }
+    }
+
+    return own == 0 ? score : -score;
+}
+
+int find_forced_win(Game *g, bool threes, int max_length, int time_limit_ms,
+                    Move **line) {
+    // Wins come from threats the other player cannot stop being forced to
+    // give up (zugzwang) rather than from sequences of threats
+    return 0;
+}
+
+/**
+ * Bitboards of the solver: each column takes COLUMN_BITS bits from its
+ * bottom cell up, the top one always empty, so that position + mask is a
+ * unique key of a position. position holds the stones of the player to move
+ * and mask those of both.
+ */
+static uint64_t bottom_mask, board_mask;
+static int column_order[COLUMNS];
+
+/**
+ * Transposition table of the solver, kept from one move to the next. Each
+ * entry holds the key of a position in its upper bits, then whether its
+ * score is an upper or a lower bound, then the score plus SCORE_OFFSET.
+ */
+static uint64_t *solver_table;
+
+static void init_solver() {
+    static bool initialized = false;
+    if (initialized) return;
+    initialized = true;
+
+    for (int c = 0; c < COLUMNS; c++) {
+        bottom_mask |= (uint64_t)1 << c * COLUMN_BITS;
+        board_mask |= (((uint64_t)1 << ROWS) - 1) << c * COLUMN_BITS;
+        // Centre columns first, as they take part in more lines
+        column_order[c] = COLUMNS / 2 + (c % 2 == 0 ? c / 2 : -(c + 1) / 2);
+    }
+    solver_table = (uint64_t *)calloc((size_t)1 << SOLVER_TABLE_BITS,
+                                      sizeof(uint64_t));
+}
+
+static int count_bits(uint64_t bits) {
+    int n = 0;
+    for (; bits; bits &= bits - 1) n++;
+    return n;
+}
+
+static uint64_t column_cells(int c) {
+    return (((uint64_t)1 << ROWS) - 1) << c * COLUMN_BITS;
+}
+
+static uint64_t playable_cells(uint64_t mask) {
+    return (mask + bottom_mask) & board_mask;
+}
+
+/*
+ * Empty cells that would complete four for the stones of position, whether
+ * playable yet or not.
+ */
+static uint64_t winning_cells(uint64_t position, uint64_t mask) {
+    // Vertical lines can only be completed from above
+    uint64_t cells = (position << 1) & (position << 2) & (position << 3);
+
+    // Horizontal, then both diagonals
+    int shifts[3] = {COLUMN_BITS, COLUMN_BITS - 1, COLUMN_BITS + 1};
+    for (int i = 0; i < 3; i++) {
+        int s = shifts[i];
+        uint64_t pair = (position << s) & (position << 2 * s);
+        cells |= pair & (position << 3 * s);
+        cells |= pair & (position >> s);
+        pair = (position >> s) & (position >> 2 * s);
+        cells |= pair & (position << s);
+        cells |= pair & (position >> 3 * s);
+    }
+
+    return cells & (board_mask ^ mask);
+}
+
+/*
+ * Playable cells that do not let the other player complete four right
+ * after, for a player who cannot complete four at once: none if the other
+ * player has two playable wins, as both cannot be blocked.
+ */
+static uint64_t safe_moves(uint64_t position, uint64_t mask) {
+    uint64_t playable = playable_cells(mask);
+    uint64_t threats = winning_cells(position ^ mask, mask);
+    uint64_t forced = playable & threats;
+    if (forced) {
+        if (forced & (forced - 1)) return 0;
+        playable = forced;
+    }
+
+    return playable & ~(threats >> 1);
+}
+
+/*
+ * Exact score of a position, in which the player to move cannot complete
+ * four at once, if it lies within (alpha, beta), and a bound otherwise. A
+ * player winning with their stone number k from the end of the game, counted
+ * from the last stone they could play, scores k, and the loser -k; a draw
+ * scores 0.
+ */
+static int solver_negamax(long long *nodes, uint64_t position, uint64_t mask,
+                          int moves, int alpha, int beta) {
+    (*nodes)++;
+    uint64_t next = safe_moves(position, mask);
+    if (next == 0) return -(CELLS - moves) / 2;
+    if (moves >= CELLS - 2) return 0;
+
+    // Neither player can win before their next stone
+    int min = -(CELLS - 2 - moves) / 2, max = (CELLS - 1 - moves) / 2;
+    if (alpha < min) alpha = min;
+    if (beta > max) beta = max;
+    if (alpha >= beta) return alpha;
+
+    uint64_t key = position + mask;
+    uint64_t *slot = &solver_table[(key * 0x9E3779B97F4A7C15ULL) >>
+                                   (64 - SOLVER_TABLE_BITS)];
+    if (*slot >> 16 == key) {
+        int score = (int)(*slot & 0xFF) - SCORE_OFFSET;
+        if ((*slot >> 8 & 0xFF) == UPPER_BOUND && score < beta) beta = score;
+        if ((*slot >> 8 & 0xFF) == LOWER_BOUND && score > alpha)
+            alpha = score;
+        if (alpha >= beta) return alpha;
+    }
+
+    // Moves making the most winning cells first
+    uint64_t candidates[COLUMNS];
+    int threats[COLUMNS], n = 0;
+    for (int i = 0; i < COLUMNS; i++) {
+        uint64_t move = next & column_cells(column_order[i]);
+        if (!move) continue;
+
+        int count = count_bits(winning_cells(position | move, mask));
+        int j = n++;
+        for (; j > 0 && threats[j - 1] < count; j--) {
+            candidates[j] = candidates[j - 1];
+            threats[j] = threats[j - 1];
+        }
+        candidates[j] = move;
+        threats[j] = count;
+    }
+
+    for (int i = 0; i < n; i++) {
+        // The stones of the other player are the ones not of this one
+        int score = -solver_negamax(nodes, position ^ mask,
+                                    mask | candidates[i], moves + 1, -beta,
+                                    -alpha);
+        if (score >= beta) {
+            *slot = key << 16 | LOWER_BOUND << 8 | (score + SCORE_OFFSET);
+            return score;
+        }
+        if (score > alpha) alpha = score;
+    }
+
+    *slot = key << 16 | UPPER_BOUND << 8 | (alpha + SCORE_OFFSET);
+    return alpha;
+}
+
+/*
+ * Exact score of a position, narrowed down by null-window searches, which
+ * are the fastest to fail high or low. The guesses lean towards 0, the
+ * score of most positions searched.
+ */
+static int solve_score(long long *nodes, uint64_t position, uint64_t mask,
+                       int moves) {
+    if (winning_cells(position, mask) & playable_cells(mask))
+        return (CELLS + 1 - moves) / 2;
+
+    int min = -(CELLS - moves) / 2, max = (CELLS + 1 - moves) / 2;
+    while (min < max) {
+        int guess = min + (max - min) / 2;
+        if (guess <= 0 && min / 2 < guess)
+            guess = min / 2;
+        else if (guess >= 0 && max / 2 > guess)
+            guess = max / 2;
+
+        int score =
+            solver_negamax(nodes, position, mask, moves, guess, guess + 1);
+        if (score <= guess)
+            max = score;
+        else
+            min = score;
+    }
+
+    return min;
+}
+
+Move *solve_position(Game *g, GameState *result, int *length,
+                     long long *nodes) {
+    char *board = (char *)g->board;
+    int moves = 0;
+    for (int i = 0; i < ROWS * COLUMNS; i++) moves += board[i] != '.';
+    if (CELLS - moves > SOLVER_EMPTY_CELLS ||
+        is_game_over(g) != GAME_NOT_FINISHED)
+        return NULL;
+
+    init_solver();
+    char symbol = g->player_turn == PLAYER1 ? 'X' : 'O';
+    uint64_t position = 0, mask = 0;
+    for (int r = 0; r < ROWS; r++) {
+        for (int c = 0; c < COLUMNS; c++) {
+            char cell = board[r * COLUMNS + c];
+            uint64_t bit = (uint64_t)1 << (c * COLUMN_BITS + ROWS - 1 - r);
+            if (cell != '.') mask |= bit;
+            if (cell == symbol) position |= bit;
+        }
+    }
+
+    *nodes = 0;
+    int score = solve_score(nodes, position, mask, moves);
+
+    // A move keeping the score: the table makes checking each one fast
+    uint64_t wins = winning_cells(position, mask) & playable_cells(mask);
+    uint64_t safe = safe_moves(position, mask);
+    int best = -1;
+    for (int i = 0; i < COLUMNS && best < 0; i++) {
+        int c = column_order[i];
+        uint64_t move = playable_cells(mask) & column_cells(c);
+        if (!move) continue;
+
+        bool keeps;
+        if (move & wins)
+            keeps = true;
+        else if (!(move & safe))
+            keeps = -(CELLS - moves) / 2 >= score;
+        else
+            keeps = solver_negamax(nodes, position ^ mask, mask | move,
+                                   moves + 1, -score, -score + 1) <= -score;
+        if (keeps) best = c;
+    }
+
+    // The move number, from 0, of the stone that ends the game
+    int last = CELLS - 1;
+    if (score != 0) {
+        int winner_moves = score > 0 ? moves : moves + 1;
+        last = CELLS + 1 - 2 * (score > 0 ? score : -score);
+        if ((last - winner_moves) % 2 != 0) last--;
+    }
+    *length = last - moves + 1;
+
+    Player winner = (score > 0) == (g->player_turn == PLAYER1) ? PLAYER1
+                                                               : PLAYER2;
+    *result = score == 0            ? GAME_DRAWN
+              : winner == PLAYER1 ? GAME_WON_BY_PLAYER1
+                                  : GAME_WON_BY_PLAYER2;
+
+    Move *m = (Move *)malloc(sizeof(Move));
+    m->c = best + 1;
+    return m;
+}
+
+bool probe_endgame(Game *g, GameState *result, int *length) {
+    // No endgame databases for connect 4
+    return false;
+}
+
 GameState evaluate_game_state(Game *g) {
     char *board = (char *)g->board;
 
@@ -292,6 +741,10 @@ void print_move(Game *g, Move *m) {
     printf("Col: %d\n\n", m->c);
 }
 
+void format_move(Move *m, char *str, int size) {
+    snprintf(str, size, "%d", m->c);
+}
+
 void print(char *str) {
     printf("%s\n", str);
 }
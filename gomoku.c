@@ -1,16 +1,207 @@
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+#include "ai.h"
 #include "game.h"
 
 #define BOARD_SIZE 12
+#define WIN_LENGTH 5
+#define ROLLOUT_RADIUS 1
+#define NO_CANDIDATE 0xFF
+#define FIVE_VALUE 1000
+#define OPEN_FOUR_VALUE 800
+#define FOUR_VALUE 100
+#define OPEN_THREE_VALUE 100
+#define O_CODE (WIN_LENGTH + 1)
+#define NUM_LINES (6 * BOARD_SIZE - 2)
+#define THREAT_TIME_CHECK 256
+#define THREAT_TABLE_SIZE (1 << 16)
+#define THREAT_DEPTH_MASK 0xFF
 
 typedef struct Move {
     int r, c;
 } Move;
 
+/**
+ * Incrementally maintained data kept in Game.extra1, so that game over checks
+ * and rollout move generation do not have to rescan the board.
+ */
+typedef struct GomokuState {
+    GameState result; /** Result, updated by make_move. */
+    int num_stones;   /** Number of stones on the board. */
+    /** Number of stones within ROLLOUT_RADIUS of each cell. */
+    unsigned char neighbours[BOARD_SIZE * BOARD_SIZE];
+    /** Empty cells with at least one neighbouring stone. */
+    unsigned char candidates[BOARD_SIZE * BOARD_SIZE];
+    /** Position of each cell in candidates, or NO_CANDIDATE. */
+    unsigned char candidate_index[BOARD_SIZE * BOARD_SIZE];
+    int num_candidates;
+    /** Index in line_patterns of each row, column and diagonal. */
+    uint32_t lines[NUM_LINES];
+    /** Zobrist hash of the stones of the position under each symmetry. */
+    uint64_t hashes[SQUARE_SYMMETRIES];
+} GomokuState;
+
+/**
+ * Patterns of both players, X first, on one line of the board. A four is a
+ * window of five cells holding four stones of a player and an empty cell,
+ * and an open three a window of six with both ends empty and three of the
+ * four cells between them held by the player, the other empty.
+ */
+typedef struct LinePatterns {
+    /** Windows of five open to the player, weighted by its stones. */
+    unsigned char score[2];
+    /** Empty cells that would make five. */
+    unsigned char fours[2];
+    /** Whether the line has an open three of the player and no four. */
+    unsigned char open_threes[2];
+} LinePatterns;
+
+/**
+ * Patterns of every possible content of every line length, so that the
+ * patterns of a line are found with one lookup. The content of a line is
+ * coded in base 3, one digit per cell from its first (0 for an empty cell,
+ * 1 for X, 2 for O), and the lines of each length take 3^length entries.
+ */
+static LinePatterns *line_patterns;
+
+/** Line through each cell in each direction. */
+static unsigned char cell_lines[BOARD_SIZE * BOARD_SIZE][4];
+/** Power of 3 of the digit of each cell in each of its lines. */
+static uint32_t cell_digits[BOARD_SIZE * BOARD_SIZE][4];
+/** Index in line_patterns of each line while it is empty. */
+static uint32_t line_offsets[NUM_LINES];
+/** Cells of each line, in the order of their digits, and their number. */
+static unsigned char line_cells[NUM_LINES][BOARD_SIZE];
+static unsigned char line_lengths[NUM_LINES];
+
+/** Zobrist keys of X and O on each cell, and of O to move. */
+static uint64_t hash_keys[BOARD_SIZE * BOARD_SIZE][2], turn_key;
+
+/** Cell that each symmetry of the board maps each cell to. */
+static unsigned char symmetric_cells[SQUARE_SYMMETRIES]
+                                    [BOARD_SIZE * BOARD_SIZE];
+
+static const int directions[4][2] = {{0, 1}, {1, 0}, {1, 1}, {1, -1}};
+
+/*
+ * Finds the patterns of a line of n cells, given by their codes: 0 for an
+ * empty cell, 1 for X and O_CODE for O, so that the sum of the codes of a
+ * window tells how many stones of each player it holds. Open threes are
+ * only counted once per line, and not on lines where the player has a four.
+ */
+static void scan_line(unsigned char *cells, int n, LinePatterns *patterns) {
+    // Values of the windows open to each player, by the sum of their codes
+    static const int values[2][WIN_LENGTH * O_CODE + 1] = {
+        {[1] = 1, [2] = 4, [3] = 16},
+        {[O_CODE] = 1, [2 * O_CODE] = 4, [3 * O_CODE] = 16}};
+    memset(patterns, 0, sizeof(LinePatterns));
+    if (n < WIN_LENGTH) return;
+
+    int four_cells[2] = {0, 0};
+    int sum = 0;
+    for (int i = 0; i < WIN_LENGTH - 1; i++) sum += cells[i];
+    for (int i = WIN_LENGTH - 1; i < n; i++) {
+        sum += cells[i];
+        patterns->score[0] += values[0][sum];
+        patterns->score[1] += values[1][sum];
+        if (sum == WIN_LENGTH - 1 || sum == (WIN_LENGTH - 1) * O_CODE) {
+            int k = i;
+            while (cells[k] != 0) k--;
+            four_cells[sum == WIN_LENGTH - 1 ? 0 : 1] |= 1 << k;
+        }
+        sum -= cells[i - WIN_LENGTH + 1];
+    }
+
+    bool open_three[2] = {false, false};
+    for (int i = 0; i + WIN_LENGTH < n; i++) {
+        int inner = 0;
+        for (int k = 1; k < WIN_LENGTH; k++) inner += cells[i + k];
+        bool open = cells[i] == 0 && cells[i + WIN_LENGTH] == 0;
+        if (open && inner == 3) open_three[0] = true;
+        if (open && inner == 3 * O_CODE) open_three[1] = true;
+    }
+
+    for (int p = 0; p < 2; p++) {
+        for (; four_cells[p]; four_cells[p] &= four_cells[p] - 1)
+            patterns->fours[p]++;
+        patterns->open_threes[p] = patterns->fours[p] == 0 && open_three[p];
+    }
+}
+
+/*
+ * Fills line_patterns and the lines of each cell, the first time a game is
+ * set up.
+ */
+static void init_line_patterns() {
+    static bool initialized = false;
+    if (initialized) return;
+    initialized = true;
+
+    uint32_t offsets[BOARD_SIZE + 1];
+    uint32_t size = 0, count = 1;
+    for (int n = 0; n <= BOARD_SIZE; n++, count *= 3) {
+        offsets[n] = size;
+        size += count;
+    }
+
+    line_patterns = (LinePatterns *)malloc(sizeof(LinePatterns) * size);
+    count = 1;
+    for (int n = 0; n <= BOARD_SIZE; n++, count *= 3) {
+        for (uint32_t code = 0; code < count; code++) {
+            unsigned char cells[BOARD_SIZE];
+            uint32_t rest = code;
+            for (int i = 0; i < n; i++, rest /= 3)
+                cells[i] = rest % 3 == 0 ? 0 : rest % 3 == 1 ? 1 : O_CODE;
+            scan_line(cells, n, &line_patterns[offsets[n] + code]);
+        }
+    }
+
+    // Rows, then columns, then diagonals by r - c and by r + c
+    for (int r = 0; r < BOARD_SIZE; r++) {
+        for (int c = 0; c < BOARD_SIZE; c++) {
+            int index = r * BOARD_SIZE + c;
+            int diagonal = c - r, anti_diagonal = r + c - (BOARD_SIZE - 1);
+            int lines[4] = {r, BOARD_SIZE + c,
+                            3 * BOARD_SIZE - 1 + diagonal,
+                            5 * BOARD_SIZE - 2 + anti_diagonal};
+            int positions[4] = {c, r, r < c ? r : c,
+                                anti_diagonal > 0 ? r - anti_diagonal : r};
+            int lengths[4] = {BOARD_SIZE, BOARD_SIZE,
+                              BOARD_SIZE - abs(diagonal),
+                              BOARD_SIZE - abs(anti_diagonal)};
+
+            for (int d = 0; d < 4; d++) {
+                uint32_t digit = 1;
+                for (int i = 0; i < positions[d]; i++) digit *= 3;
+                cell_lines[index][d] = lines[d];
+                cell_digits[index][d] = digit;
+                line_offsets[lines[d]] = offsets[lengths[d]];
+                line_cells[lines[d]][positions[d]] = index;
+                line_lengths[lines[d]] = lengths[d];
+            }
+        }
+    }
+}
+
+/*
+ * Sets up the Zobrist keys and the cells of the symmetries the first time a
+ * game is set up.
+ */
+static void init_hash_keys() {
+    static bool initialized = false;
+    if (initialized) return;
+    initialized = true;
+
+    uint64_t seed = 5;
+    fill_hash_keys(&hash_keys[0][0], BOARD_SIZE * BOARD_SIZE * 2, &seed);
+    fill_hash_keys(&turn_key, 1, &seed);
+    fill_square_symmetries(&symmetric_cells[0][0], BOARD_SIZE);
+}
+
 void init() {
     srand(time(NULL));
 }
@@ -46,8 +237,23 @@ void init_game_state(Game *g) {
     char *board = (char *)malloc(sizeof(char) * BOARD_SIZE * BOARD_SIZE);
     memset(board, '.', BOARD_SIZE * BOARD_SIZE);
 
+    init_line_patterns();
+    init_hash_keys();
+
+    GomokuState *state = (GomokuState *)malloc(sizeof(GomokuState));
+    state->result = GAME_NOT_FINISHED;
+    state->num_stones = 0;
+    memset(state->neighbours, 0, sizeof(state->neighbours));
+    memset(state->candidate_index, NO_CANDIDATE,
+           sizeof(state->candidate_index));
+    state->num_candidates = 0;
+    memcpy(state->lines, line_offsets, sizeof(state->lines));
+    memset(state->hashes, 0, sizeof(state->hashes));
+
     g->board = (void *)board;
     g->result = GAME_NOT_FINISHED;
+    g->extra1 = (void *)state;
+    g->extra2 = NULL;
 }
 
 Game *copy_game_state(Game *g) {
@@ -66,9 +272,21 @@ Game *copy_game_state(Game *g) {
     memcpy(board, g->board, BOARD_SIZE * BOARD_SIZE);
     copy->board = (void *)board;
 
+    GomokuState *state = (GomokuState *)malloc(sizeof(GomokuState));
+    memcpy(state, g->extra1, sizeof(GomokuState));
+    copy->extra1 = (void *)state;
+    copy->extra2 = NULL;
+
     return copy;
 }
 
+void copy_game_state_into(Game *dst, Game *src) {
+    dst->player_turn = src->player_turn;
+    dst->result = src->result;
+    memcpy(dst->board, src->board, BOARD_SIZE * BOARD_SIZE);
+    memcpy(dst->extra1, src->extra1, sizeof(GomokuState));
+}
+
 Move *copy_move(Move *m) {
     if (!m) return NULL;
 
@@ -107,13 +325,89 @@ bool is_valid_move(Game *g, Move *m) {
     return true;
 }
 
+static int count_stones(char *board, int r, int c, int dr, int dc,
+                        char symbol) {
+    int count = 0;
+
+    r += dr;
+    c += dc;
+    while (r >= 0 && r < BOARD_SIZE && c >= 0 && c < BOARD_SIZE &&
+           board[r * BOARD_SIZE + c] == symbol) {
+        count++;
+        r += dr;
+        c += dc;
+    }
+
+    return count;
+}
+
+/*
+ * Checks whether a stone of the given symbol at index completes a line of
+ * WIN_LENGTH. The cell itself is not read, so this works for empty cells too.
+ */
+static bool makes_five(char *board, int index, char symbol) {
+    int r = index / BOARD_SIZE, c = index % BOARD_SIZE;
+
+    for (int d = 0; d < 4; d++) {
+        int dr = directions[d][0], dc = directions[d][1];
+        if (1 + count_stones(board, r, c, dr, dc, symbol) +
+                count_stones(board, r, c, -dr, -dc, symbol) >=
+            WIN_LENGTH)
+            return true;
+    }
+
+    return false;
+}
+
+static void add_candidate(GomokuState *state, int index) {
+    state->candidate_index[index] = state->num_candidates;
+    state->candidates[state->num_candidates++] = index;
+}
+
+static void remove_candidate(GomokuState *state, int index) {
+    int last = state->candidates[--state->num_candidates];
+    state->candidates[state->candidate_index[index]] = last;
+    state->candidate_index[last] = state->candidate_index[index];
+    state->candidate_index[index] = NO_CANDIDATE;
+}
+
 bool make_move(Game *g, Move *m) {
     char *board = (char *)g->board;
+    GomokuState *state = (GomokuState *)g->extra1;
     int index = (m->r - 1) * BOARD_SIZE + (m->c - 1);
 
     char symbol = g->player_turn == PLAYER1 ? 'X' : 'O';
     board[index] = symbol;
 
+    uint32_t digit = symbol == 'X' ? 1 : 2;
+    for (int d = 0; d < 4; d++)
+        state->lines[cell_lines[index][d]] += digit * cell_digits[index][d];
+    for (int s = 0; s < SQUARE_SYMMETRIES; s++)
+        state->hashes[s] ^= hash_keys[symmetric_cells[s][index]][digit - 1];
+
+    state->num_stones++;
+    if (state->candidate_index[index] != NO_CANDIDATE)
+        remove_candidate(state, index);
+
+    for (int r = m->r - 1 - ROLLOUT_RADIUS; r <= m->r - 1 + ROLLOUT_RADIUS;
+         r++) {
+        for (int c = m->c - 1 - ROLLOUT_RADIUS; c <= m->c - 1 + ROLLOUT_RADIUS;
+             c++) {
+            if (r < 0 || r >= BOARD_SIZE || c < 0 || c >= BOARD_SIZE) continue;
+
+            int neighbour = r * BOARD_SIZE + c;
+            if (state->neighbours[neighbour]++ == 0 &&
+                board[neighbour] == '.')
+                add_candidate(state, neighbour);
+        }
+    }
+
+    if (makes_five(board, index, symbol))
+        state->result = symbol == 'X' ? GAME_WON_BY_PLAYER1
+                                      : GAME_WON_BY_PLAYER2;
+    else if (state->num_stones == BOARD_SIZE * BOARD_SIZE)
+        state->result = GAME_DRAWN;
+
     return true;
 }
 
@@ -172,69 +466,489 @@ void destroy_list_of_moves(Move **moves, int num_moves) {
     free(moves);
 }
 
-GameState evaluate_game_state(Game *g) {
+static Move **single_move(int index, int *num_moves) {
+    Move **moves = (Move **)malloc(sizeof(Move *));
+    moves[0] = (Move *)malloc(sizeof(Move));
+    moves[0]->r = index / BOARD_SIZE + 1;
+    moves[0]->c = index % BOARD_SIZE + 1;
+    *num_moves = 1;
+
+    return moves;
+}
+
+Move **get_rollout_moves(Game *g, int *num_moves) {
+    GomokuState *state = (GomokuState *)g->extra1;
+    if (state->num_candidates == 0) return get_possible_moves(g, num_moves);
+
     char *board = (char *)g->board;
+    char symbol = g->player_turn == PLAYER1 ? 'X' : 'O';
+    char opponent = g->player_turn == PLAYER1 ? 'O' : 'X';
 
-    // Check horizontal, vertical, and both diagonal directions for a win
-    for (int i = 0; i < BOARD_SIZE; i++) {
-        for (int j = 0; j < BOARD_SIZE; j++) {
-            char current = board[i * BOARD_SIZE + j];
-            if (current == 'X' || current == 'O') {
-                // Check horizontal
-                if (j <= BOARD_SIZE - 4) {
-                    if (current == board[i * BOARD_SIZE + (j + 1)] &&
-                        current == board[i * BOARD_SIZE + (j + 2)] &&
-                        current == board[i * BOARD_SIZE + (j + 3)] &&
-                        current == board[i * BOARD_SIZE + (j + 4)]) {
-                        return current == 'X' ? GAME_WON_BY_PLAYER1
-                                              : GAME_WON_BY_PLAYER2;
-                    }
-                }
+    // Take an immediate win, otherwise block the opponent's four
+    int block = -1;
+    for (int i = 0; i < state->num_candidates; i++) {
+        int index = state->candidates[i];
+        if (makes_five(board, index, symbol))
+            return single_move(index, num_moves);
+        if (block < 0 && makes_five(board, index, opponent)) block = index;
+    }
 
-                // Check vertical
-                if (i <= BOARD_SIZE - 4) {
-                    if (current == board[(i + 1) * BOARD_SIZE + j] &&
-                        current == board[(i + 2) * BOARD_SIZE + j] &&
-                        current == board[(i + 3) * BOARD_SIZE + j] &&
-                        current == board[(i + 4) * BOARD_SIZE + j]) {
-                        return current == 'X' ? GAME_WON_BY_PLAYER1
-                                              : GAME_WON_BY_PLAYER2;
-                    }
-                }
+    if (block >= 0) return single_move(block, num_moves);
 
-                // Check diagonal (top-left to bottom-right)
-                if (i <= BOARD_SIZE - 4 && j <= BOARD_SIZE - 4) {
-                    if (current == board[(i + 1) * BOARD_SIZE + (j + 1)] &&
-                        current == board[(i + 2) * BOARD_SIZE + (j + 2)] &&
-                        current == board[(i + 3) * BOARD_SIZE + (j + 3)] &&
-                        current == board[(i + 4) * BOARD_SIZE + (j + 4)]) {
-                        return current == 'X' ? GAME_WON_BY_PLAYER1
-                                              : GAME_WON_BY_PLAYER2;
-                    }
-                }
+    Move **moves = (Move **)malloc(sizeof(Move *) * BOARD_SIZE * BOARD_SIZE);
+    for (int i = 0; i < state->num_candidates; i++) {
+        Move *m = (Move *)malloc(sizeof(Move));
+        m->r = state->candidates[i] / BOARD_SIZE + 1;
+        m->c = state->candidates[i] % BOARD_SIZE + 1;
+        moves[i] = m;
+    }
+    *num_moves = state->num_candidates;
 
-                // Check diagonal (bottom-left to top-right)
-                if (i >= 3 && j <= BOARD_SIZE - 4) {
-                    if (current == board[(i - 1) * BOARD_SIZE + (j + 1)] &&
-                        current == board[(i - 2) * BOARD_SIZE + (j + 2)] &&
-                        current == board[(i - 3) * BOARD_SIZE + (j + 3)] &&
-                        current == board[(i - 4) * BOARD_SIZE + (j + 4)]) {
-                        return current == 'X' ? GAME_WON_BY_PLAYER1
-                                              : GAME_WON_BY_PLAYER2;
-                    }
-                }
+    return moves;
+}
+
+Move **get_capture_moves(Game *g, int *num_moves) {
+    // Nothing is captured in gomoku
+    *num_moves = 0;
+    return NULL;
+}
+
+uint64_t hash_game_state(Game *g) {
+    GomokuState *state = (GomokuState *)g->extra1;
+
+    // Symmetry 0 is the identity
+    return state->hashes[0] ^ (g->player_turn == PLAYER2 ? turn_key : 0);
+}
+
+uint64_t hash_canonical_state(Game *g, int *symmetry) {
+    GomokuState *state = (GomokuState *)g->extra1;
+
+    *symmetry = 0;
+    for (int s = 1; s < SQUARE_SYMMETRIES; s++) {
+        if (state->hashes[s] < state->hashes[*symmetry]) *symmetry = s;
+    }
+
+    return state->hashes[*symmetry] ^
+           (g->player_turn == PLAYER2 ? turn_key : 0);
+}
+
+int transform_move_id(int move_id, int symmetry, bool inverse) {
+    if (inverse) symmetry = invert_square_symmetry(symmetry);
+    return symmetric_cells[symmetry][move_id];
+}
+
+int get_move_id(Move *m) {
+    return (m->r - 1) * BOARD_SIZE + (m->c - 1);
+}
+
+int get_num_move_ids() {
+    return BOARD_SIZE * BOARD_SIZE;
+}
+
+static bool is_empty(char *board, int r, int c) {
+    return r >= 0 && r < BOARD_SIZE && c >= 0 && c < BOARD_SIZE &&
+           board[r * BOARD_SIZE + c] == '.';
+}
+
+/*
+ * Scores the line a stone of symbol at (r, c) would be part of in one
+ * direction, by its length and how many of its ends are open.
+ */
+static int line_threat(char *board, int r, int c, int dr, int dc,
+                       char symbol) {
+    static const int weights[WIN_LENGTH][3] = {
+        {0, 0, 0}, {0, 0, 0}, {0, 1, 2}, {0, 2, 8}, {0, 8, 32}};
+    int forward = count_stones(board, r, c, dr, dc, symbol);
+    int backward = count_stones(board, r, c, -dr, -dc, symbol);
+    int length = 1 + forward + backward;
+    if (length >= WIN_LENGTH) return 64;
+
+    int open =
+        is_empty(board, r + (forward + 1) * dr, c + (forward + 1) * dc) +
+        is_empty(board, r - (backward + 1) * dr, c - (backward + 1) * dc);
+
+    return weights[length][open];
+}
+
+int get_move_prior(Game *g, Move *m) {
+    GomokuState *state = (GomokuState *)g->extra1;
+    char *board = (char *)g->board;
+    char symbol = g->player_turn == PLAYER1 ? 'X' : 'O';
+    char opponent = g->player_turn == PLAYER1 ? 'O' : 'X';
+    int r = m->r - 1, c = m->c - 1;
+
+    // Adjacent stones, plus the lines the move makes and the ones it blocks
+    int prior = state->neighbours[get_move_id(m)];
+    for (int d = 0; d < 4; d++) {
+        int dr = directions[d][0], dc = directions[d][1];
+        prior += 2 * line_threat(board, r, c, dr, dc, symbol) +
+                 line_threat(board, r, c, dr, dc, opponent);
+    }
+
+    return prior;
+}
+
+/*
+ * Evaluates a position by the line patterns of both players, taking into
+ * account who moves next: a player to move with a four completes five, a
+ * four of the other player must be blocked first, two of them cannot both
+ * be, and an open three of the player to move becomes an open four, which
+ * cannot be blocked, unless the other player has a four to play first.
+ */
+int evaluate(Game *g) {
+    GomokuState *state = (GomokuState *)g->extra1;
+    int fours[2] = {0, 0}, open_fours[2] = {0, 0}, open_threes[2] = {0, 0};
+    int scores[2] = {0, 0};
+
+    for (int line = 0; line < NUM_LINES; line++) {
+        LinePatterns *patterns = &line_patterns[state->lines[line]];
+        for (int p = 0; p < 2; p++) {
+            scores[p] += patterns->score[p];
+            fours[p] += patterns->fours[p];
+            open_fours[p] += patterns->fours[p] >= 2;
+            open_threes[p] += patterns->open_threes[p];
+        }
+    }
+
+    int own = g->player_turn == PLAYER1 ? 0 : 1, other = 1 - own;
+    int score = scores[own] - scores[other];
+    if (fours[own] > 0) return score + FIVE_VALUE;
+    if (open_fours[other] > 0 || fours[other] > 1)
+        return score - OPEN_FOUR_VALUE;
+    if (fours[other] == 0 && open_threes[own] > 0)
+        return score + OPEN_FOUR_VALUE / 2;
+    if (open_threes[other] > 1) score -= OPEN_THREE_VALUE;
+
+    return score + OPEN_THREE_VALUE * (open_threes[own] - open_threes[other]) -
+           FOUR_VALUE * fours[other];
+}
+
+/**
+ * Threats a stone can make, by how soon they make five if not answered: a
+ * four on the next move, an open three by an open four first.
+ */
+typedef enum {
+    THREAT_NONE,
+    THREAT_THREE,
+    THREAT_FOUR,
+} Threat;
+
+/**
+ * State of a threat-space search, which puts stones on a copy of the board
+ * and its lines and takes them off again.
+ */
+typedef struct ThreatSearch {
+    char board[BOARD_SIZE * BOARD_SIZE];
+    uint32_t lines[NUM_LINES];
+    int attacker;  /** Player looking for a win, 0 for X and 1 for O. */
+    bool threes;   /** Whether open threes are tried as well as fours. */
+    uint64_t hash; /** Zobrist hash of the stones, without the turn. */
+    /**
+     * Positions the attacker to move was found not to win from, by hash,
+     * with the number of threats tried in the bits of THREAT_DEPTH_MASK, or
+     * NULL. The same threats played in another order lead to them again.
+     */
+    uint64_t *failed;
+    /** Cells of the line being tried, then of the winning line. */
+    int path[BOARD_SIZE * BOARD_SIZE];
+    int length; /** Number of moves of the winning line. */
+    long nodes;
+    /** Whether a line ran out of threats to try before making five. */
+    bool depth_limited;
+    struct timespec start;
+    int time_limit_ms;
+    bool stopped;
+} ThreatSearch;
+
+static void put_stone(ThreatSearch *ts, int index, int p) {
+    ts->board[index] = p == 0 ? 'X' : 'O';
+    ts->hash ^= hash_keys[index][p];
+    for (int d = 0; d < 4; d++)
+        ts->lines[cell_lines[index][d]] += (p + 1) * cell_digits[index][d];
+}
+
+static void take_stone(ThreatSearch *ts, int index, int p) {
+    ts->board[index] = '.';
+    ts->hash ^= hash_keys[index][p];
+    for (int d = 0; d < 4; d++)
+        ts->lines[cell_lines[index][d]] -= (p + 1) * cell_digits[index][d];
+}
+
+/*
+ * Finds up to two empty cells where a stone of player p makes five, looking
+ * only along the lines where p has a four.
+ */
+static int find_fives(ThreatSearch *ts, int p, int cells[2]) {
+    char symbol = p == 0 ? 'X' : 'O';
+    int n = 0;
+
+    for (int line = 0; line < NUM_LINES; line++) {
+        if (line_patterns[ts->lines[line]].fours[p] == 0) continue;
+
+        for (int i = 0; i < line_lengths[line]; i++) {
+            int index = line_cells[line][i];
+            if (ts->board[index] != '.' || (n == 1 && cells[0] == index) ||
+                !makes_five(ts->board, index, symbol))
+                continue;
+
+            cells[n++] = index;
+            if (n == 2) return n;
+        }
+    }
+
+    return n;
+}
+
+/*
+ * Strongest threat a stone of player p at an empty cell makes, found from
+ * the patterns of its lines before and after it.
+ */
+static Threat threat_at(ThreatSearch *ts, int index, int p) {
+    Threat threat = THREAT_NONE;
+
+    for (int d = 0; d < 4; d++) {
+        uint32_t line = ts->lines[cell_lines[index][d]];
+        LinePatterns *before = &line_patterns[line];
+        LinePatterns *after =
+            &line_patterns[line + (p + 1) * cell_digits[index][d]];
+        if (after->fours[p] > before->fours[p]) return THREAT_FOUR;
+        if (after->open_threes[p] > before->open_threes[p])
+            threat = THREAT_THREE;
+    }
+
+    return threat;
+}
+
+/*
+ * Finds the empty cells where a stone of player p makes a four, into
+ * threats[0], and if threes is set those where it makes an open three, into
+ * threats[1]. Only the lines with a window of five holding three stones of p
+ * and no other (two for threes) are looked along, which such windows alone
+ * score 16 (4) for in scan_line.
+ */
+static void find_threats(ThreatSearch *ts, int p, bool threes,
+                         int threats[2][BOARD_SIZE * BOARD_SIZE],
+                         int num_threats[2]) {
+    int min_score = threes ? 4 : 16;
+    bool seen[BOARD_SIZE * BOARD_SIZE] = {false};
+    num_threats[0] = num_threats[1] = 0;
+
+    for (int line = 0; line < NUM_LINES; line++) {
+        if (line_patterns[ts->lines[line]].score[p] < min_score) continue;
+
+        for (int i = 0; i < line_lengths[line]; i++) {
+            int index = line_cells[line][i];
+            if (ts->board[index] != '.' || seen[index]) continue;
+            seen[index] = true;
+
+            Threat threat = threat_at(ts, index, p);
+            if (threat == THREAT_FOUR)
+                threats[0][num_threats[0]++] = index;
+            else if (threat == THREAT_THREE && threes)
+                threats[1][num_threats[1]++] = index;
+        }
+    }
+}
+
+static bool defend(ThreatSearch *ts, int ply, int depth, int index);
+
+/*
+ * Whether the attacker, to move, makes five after at most depth more
+ * threats, whatever the defender answers them with.
+ */
+static bool attack(ThreatSearch *ts, int ply, int depth) {
+    if (++ts->nodes % THREAT_TIME_CHECK == 0 && ts->time_limit_ms > 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((now.tv_sec - ts->start.tv_sec) * 1000.0 +
+                (now.tv_nsec - ts->start.tv_nsec) / 1000000.0 >=
+            ts->time_limit_ms)
+            ts->stopped = true;
+    }
+    if (ts->stopped) return false;
+
+    int p = ts->attacker;
+    int cells[2];
+    if (find_fives(ts, p, cells) > 0) {
+        ts->path[ply] = cells[0];
+        ts->length = ply + 1;
+        return true;
+    }
+    if (depth == 0) {
+        ts->depth_limited = true;
+        return false;
+    }
+
+    uint64_t *failed = NULL;
+    if (ts->failed != NULL) {
+        failed = &ts->failed[ts->hash % THREAT_TABLE_SIZE];
+        if ((*failed & ~THREAT_DEPTH_MASK) == (ts->hash & ~THREAT_DEPTH_MASK) &&
+            (int)(*failed & THREAT_DEPTH_MASK) >= depth) {
+            // It may have failed for lack of threats left, as far as known
+            ts->depth_limited = true;
+            return false;
+        }
+    }
+
+    // A four of the defender must be blocked, which only keeps the
+    // initiative when the block is a threat itself
+    int num_blocks = find_fives(ts, 1 - p, cells);
+    if (num_blocks > 1) return false;
+
+    // Fours first, as they leave the defender a single answer
+    int threats[2][BOARD_SIZE * BOARD_SIZE], num_threats[2];
+    if (num_blocks == 1) {
+        Threat threat = threat_at(ts, cells[0], p);
+        threats[0][0] = threats[1][0] = cells[0];
+        num_threats[0] = threat == THREAT_FOUR;
+        num_threats[1] = threat == THREAT_THREE && ts->threes;
+    } else {
+        find_threats(ts, p, ts->threes, threats, num_threats);
+    }
+
+    for (int t = 0; t < 2; t++) {
+        for (int i = 0; i < num_threats[t]; i++) {
+            int index = threats[t][i];
+            put_stone(ts, index, p);
+            ts->path[ply] = index;
+            bool won = defend(ts, ply + 1, depth, index);
+            take_stone(ts, index, p);
+            if (won || ts->stopped) return won;
+        }
+    }
+
+    if (failed != NULL) *failed = (ts->hash & ~THREAT_DEPTH_MASK) | depth;
+    return false;
+}
+
+/*
+ * Whether the attacker wins whatever the defender, to move, answers the
+ * threat just made at index with. A four must be blocked at the cell that
+ * would make five. An open three can be broken up at any cell of its line,
+ * or answered with a four of the defender, which must be blocked first.
+ */
+static bool defend(ThreatSearch *ts, int ply, int depth, int index) {
+    int p = ts->attacker, q = 1 - p;
+    int cells[2];
+    if (find_fives(ts, q, cells) > 0) return false;
+
+    int num_fives = find_fives(ts, p, cells);
+    if (num_fives == 2) {
+        // An open four or two fours, which cannot both be blocked
+        ts->path[ply] = cells[0];
+        ts->path[ply + 1] = cells[1];
+        ts->length = ply + 2;
+        return true;
+    }
+
+    int replies[BOARD_SIZE * BOARD_SIZE], num_replies = 0;
+    if (num_fives == 1) {
+        replies[num_replies++] = cells[0];
+    } else {
+        bool seen[BOARD_SIZE * BOARD_SIZE] = {false};
+        for (int d = 0; d < 4; d++) {
+            int line = cell_lines[index][d];
+            if (!line_patterns[ts->lines[line]].open_threes[p]) continue;
+
+            for (int i = 0; i < line_lengths[line]; i++) {
+                int cell = line_cells[line][i];
+                uint32_t code =
+                    ts->lines[line] + (q + 1) * cell_digits[cell][d];
+                if (ts->board[cell] != '.' || seen[cell] ||
+                    line_patterns[code].open_threes[p])
+                    continue;
+
+                seen[cell] = true;
+                replies[num_replies++] = cell;
             }
         }
+
+        int fours[2][BOARD_SIZE * BOARD_SIZE], num_fours[2];
+        find_threats(ts, q, false, fours, num_fours);
+        for (int i = 0; i < num_fours[0]; i++) {
+            if (!seen[fours[0][i]]) replies[num_replies++] = fours[0][i];
+        }
     }
 
-    // Check for draw (if all cells are filled)
-    for (int i = 0; i < BOARD_SIZE * BOARD_SIZE; i++) {
-        if (board[i] == '.') {
-            return GAME_NOT_FINISHED;  // The game is still ongoing
+    for (int i = 0; i < num_replies; i++) {
+        put_stone(ts, replies[i], q);
+        ts->path[ply] = replies[i];
+        bool won = attack(ts, ply + 1, depth - 1);
+        take_stone(ts, replies[i], q);
+        if (!won) return false;
+    }
+
+    return true;
+}
+
+/*
+ * Looks for a win by fours alone (VCF) by increasing length, then for one
+ * by fours and open threes (VCT).
+ */
+int find_forced_win(Game *g, bool threes, int max_length, int time_limit_ms,
+                    Move **line) {
+    GomokuState *state = (GomokuState *)g->extra1;
+    if (state->result != GAME_NOT_FINISHED || max_length < 1) return 0;
+
+    ThreatSearch ts;
+    memcpy(ts.board, g->board, sizeof(ts.board));
+    memcpy(ts.lines, state->lines, sizeof(ts.lines));
+    ts.attacker = g->player_turn == PLAYER1 ? 0 : 1;
+    ts.hash = state->hashes[0];
+    ts.failed = NULL;
+    ts.nodes = 0;
+    ts.time_limit_ms = time_limit_ms;
+    ts.stopped = false;
+    clock_gettime(CLOCK_MONOTONIC, &ts.start);
+
+    if (max_length > BOARD_SIZE * BOARD_SIZE)
+        max_length = BOARD_SIZE * BOARD_SIZE;
+    int max_threats = (max_length - 1) / 2;
+
+    bool won = false;
+    for (int pass = 0; pass < (threes ? 2 : 1) && !won && !ts.stopped;
+         pass++) {
+        ts.threes = pass == 1;
+        // Wins by fours are short and found fast without the table
+        if (ts.threes)
+            ts.failed =
+                (uint64_t *)calloc(THREAT_TABLE_SIZE, sizeof(uint64_t));
+        // Every depth also finds the wins of no threats, by making five
+        ts.depth_limited = true;
+        for (int depth = max_threats > 0 ? 1 : 0;
+             depth <= max_threats && ts.depth_limited && !won && !ts.stopped;
+             depth++) {
+            ts.depth_limited = false;
+            won = attack(&ts, 0, depth);
         }
     }
+    free(ts.failed);
+    if (!won) return 0;
 
-    return GAME_DRAWN;
+    if (line != NULL) {
+        for (int i = 0; i < ts.length; i++) {
+            line[i] = (Move *)malloc(sizeof(Move));
+            line[i]->r = ts.path[i] / BOARD_SIZE + 1;
+            line[i]->c = ts.path[i] % BOARD_SIZE + 1;
+        }
+    }
+
+    return ts.length;
+}
+
+Move *solve_position(Game *g, GameState *result, int *length,
+                     long long *nodes) {
+    // The board is far too large to solve
+    return NULL;
+}
+
+bool probe_endgame(Game *g, GameState *result, int *length) {
+    // No endgame databases for gomoku
+    return false;
+}
+
+GameState evaluate_game_state(Game *g) {
+    return ((GomokuState *)g->extra1)->result;
 }
 
 GameState is_game_over(Game *g) {
@@ -316,6 +1030,10 @@ void print_move(Game *g, Move *m) {
     printf("(%d, %d)\n\n", m->r, m->c);
 }
 
+void format_move(Move *m, char *str, int size) {
+    snprintf(str, size, "%d,%d", m->r, m->c);
+}
+
 void print(char *str) {
     printf("%s\n", str);
 }
@@ -323,5 +1041,6 @@ void print(char *str) {
 void destroy_game(Game *g) {
     free((char *)g->board);
     g->board = NULL;
+    free(g->extra1);
     free(g);
 }
@@ -1,109 +1,774 @@
 #include "mcts.h"
 
+#include <float.h>
 #include <limits.h>
 #include <math.h>
+#include <stdint.h>
+#ifdef BUILD_BENCH
+#include <stdio.h>
+#endif
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
 #include "ai.h"
 #include "game.h"
+#ifdef BOOK_FILE
+#include "book.h"
+#endif
+
+/**
+ * Game-theoretic value of a node for the player who moved into it, once the
+ * search has proven it (MCTS-Solver). Proven values are ordered so that the
+ * player choosing among children prefers the largest.
+ */
+typedef enum {
+    UNPROVEN,
+    PROVEN_LOSS,
+    PROVEN_DRAW,
+    PROVEN_WIN,
+} Proof;
+
+struct Node;
+
+/**
+ * Value kept for a child that UCB1 selection must skip. It is finite because
+ * the makefile builds with -Ofast, which assumes no infinities.
+ */
+#define NO_VALUE (-FLT_MAX)
+
+/**
+ * Per-edge arrays are padded to a multiple of this many entries, so the
+ * vectorized selection needs no scalar remainder loop.
+ */
+#define SIMD_WIDTH 8
+
+/**
+ * A move from a node to one of its children. With MCTS_TRANSPOSITIONS a child
+ * can be shared by several parents, so the statistics that depend on the path
+ * (how often the move was taken, AMAF values) are kept per edge, in arrays of
+ * the parent that selection scans without touching the children.
+ */
+typedef struct Edge {
+    struct Node *child; /** NULL until the move is first tried. */
+    int move_id;
+} Edge;
 
 typedef struct Node {
     Game *game_state;
-    Move *move;
-    struct Node *parent;
-    struct Node **children;
+    Player player; /** The player who made the move leading to this node. */
+    uint64_t hash;
+    Move **moves; /** Legal moves, in the order they are tried. */
+    Edge *edges;
+    int *visit_counts; /** Iterations that went through each edge. */
+    /**
+     * Mean reward of each child, as of the last iteration through its edge,
+     * or NO_VALUE while it is untried and once it is proven.
+     */
+    float *values;
+    int *amaf_visit_counts; /** Only allocated with MCTS_RAVE. */
+    float *amaf_win_counts;
+    float *priors; /** Only allocated with MCTS_PUCT. */
     int num_children;
+    int num_tried; /** Edges before this index have been selected. */
     int visit_count;
-    double win_count;
+    double win_count; /** Accumulated reward for player. */
+    Proof proof;
+    bool kept; /** Marks the nodes reachable from the root while recycling. */
+    struct Node *next; /** Next node in the list of all allocated nodes. */
 } Node;
 
-static Node *create_node(Game *g, Move *m, Node *parent) {
+/**
+ * State of one search: every allocated node and the heap memory they hold,
+ * the transposition table, the path followed by the current iteration and the
+ * root moves still considered by sequential halving.
+ */
+typedef struct Tree {
+    Node *root;
+    Node *nodes;
+    size_t memory; /** Estimated heap bytes of the nodes and the table. */
+    Node **table;
+    Node **path;
+    int *path_edges;
+    int path_length;
+    int path_capacity;
+    int *arms; /** Root edges still in the running, best first. */
+    int num_arms;
+    int next_arm;
+} Tree;
+
+/**
+ * Visits and memory of a node, for choosing which nodes to recycle.
+ */
+typedef struct NodeSize {
+    int visit_count;
+    size_t memory;
+} NodeSize;
+
+static Proof proof_of_result(GameState result, Player player) {
+    switch (result) {
+        case GAME_DRAWN:
+            return PROVEN_DRAW;
+        case GAME_WON_BY_PLAYER1:
+            return player == PLAYER1 ? PROVEN_WIN : PROVEN_LOSS;
+        case GAME_WON_BY_PLAYER2:
+            return player == PLAYER2 ? PROVEN_WIN : PROVEN_LOSS;
+        default:
+            return UNPROVEN;
+    }
+}
+
+static Proof invert_proof(Proof proof) {
+    if (proof == PROVEN_WIN) return PROVEN_LOSS;
+    if (proof == PROVEN_LOSS) return PROVEN_WIN;
+    return proof;
+}
+
+static int padded_size(int n) {
+    return (n + SIMD_WIDTH - 1) / SIMD_WIDTH * SIMD_WIDTH;
+}
+
+/*
+ * Heap bytes taken by an allocation of size bytes, assuming glibc's malloc
+ * (an 8-byte header, 16-byte alignment and 32-byte minimum chunks).
+ */
+static size_t heap_size(size_t size) {
+    size_t chunk = (size + 8 + 15) & ~(size_t)15;
+    return chunk < 32 ? 32 : chunk;
+}
+
+/*
+ * Heap bytes of a copy of the game state, and of a list of moves as
+ * list_base_memory + list_move_memory per move. Game structures are opaque
+ * here, so they are measured once per process with mallinfo2(), fitting the
+ * list sizes on two positions. Without glibc, generous guesses are used.
+ */
+static size_t game_memory, list_base_memory, list_move_memory;
+
+static void measure_game_memory(Game *g) {
+    if (game_memory > 0) return;
+
+#if defined(__GLIBC__)
+#if __GLIBC_PREREQ(2, 33)
+    // Chunks cached by free() count as in use, so allocating them looks free.
+    // Only the second half of the copies, made once the cache is drained, is
+    // measured.
+    enum { SAMPLES = 32 };
+    Game *games[2 * SAMPLES];
+    Move **moves[2 * SAMPLES];
+    size_t before = 0;
+    for (int i = 0; i < 2 * SAMPLES; i++) {
+        if (i == SAMPLES) before = mallinfo2().uordblks;
+        games[i] = copy_game_state(g);
+    }
+    game_memory = (mallinfo2().uordblks - before) / SAMPLES;
+
+    long memory[2];
+    int num_moves[2];
+    for (int i = 0; i < 2; i++) {
+        for (int j = 0; j < 2 * SAMPLES; j++) {
+            if (j == SAMPLES) before = mallinfo2().uordblks;
+            moves[j] = get_possible_moves(games[i], &num_moves[i]);
+        }
+        memory[i] = (long)(mallinfo2().uordblks - before) / SAMPLES;
+
+        if (i == 0 && num_moves[0] > 0) make_move(games[1], moves[0][0]);
+        for (int j = 0; j < 2 * SAMPLES; j++)
+            destroy_list_of_moves(moves[j], num_moves[i]);
+    }
+    for (int i = 0; i < 2 * SAMPLES; i++) destroy_game(games[i]);
+
+    if (num_moves[0] > 0) {
+        long per_move = memory[0] / num_moves[0];
+        if (num_moves[0] != num_moves[1])
+            per_move = (memory[0] - memory[1]) / (num_moves[0] - num_moves[1]);
+        if (per_move <= 0) per_move = memory[0] / num_moves[0];
+        long base = memory[0] - per_move * num_moves[0];
+        list_move_memory = per_move;
+        list_base_memory = base > 0 ? base : 0;
+    }
+#endif
+#endif
+
+    if (game_memory == 0) game_memory = 1024;
+    if (list_move_memory == 0) list_move_memory = 64;
+}
+
+/*
+ * Heap bytes of the arrays given to a node with num_moves moves by expand().
+ */
+static size_t expansion_memory(int num_moves) {
+    size_t padded = padded_size(num_moves);
+    size_t memory = list_base_memory + list_move_memory * num_moves +
+                    heap_size(sizeof(Edge) * num_moves) +
+                    heap_size(sizeof(int) * padded) +
+                    heap_size(sizeof(float) * padded);
+    if (MCTS_RAVE)
+        memory += heap_size(sizeof(int) * num_moves) +
+                  heap_size(sizeof(float) * num_moves);
+    if (MCTS_PUCT) memory += heap_size(sizeof(float) * num_moves);
+
+    return memory;
+}
+
+static size_t node_memory(Node *n) {
+    size_t memory = heap_size(sizeof(Node)) + game_memory;
+    if (n->edges != NULL) memory += expansion_memory(n->num_children);
+
+    return memory;
+}
+
+static Node *create_node(Tree *t, Game *g, Player player, uint64_t hash) {
     Node *node = (Node *)malloc(sizeof(Node));
 
     node->game_state = copy_game_state(g);
-    node->move = copy_move(m);
-    node->parent = parent;
-    node->children = NULL;
+    node->player = player;
+    node->hash = hash;
+    // Positions of the endgame databases are proven when created
+    GameState result = is_game_over(node->game_state);
+    int length;
+    if (result == GAME_NOT_FINISHED)
+        probe_endgame(node->game_state, &result, &length);
+    node->proof = proof_of_result(result, player);
+    node->moves = NULL;
+    node->edges = NULL;
+    node->visit_counts = NULL;
+    node->values = NULL;
+    node->amaf_visit_counts = NULL;
+    node->amaf_win_counts = NULL;
+    node->priors = NULL;
     node->num_children = 0;
+    node->num_tried = 0;
     node->visit_count = 0;
     node->win_count = 0.0;
+    node->kept = false;
+    node->next = t->nodes;
+    t->nodes = node;
+    t->memory += node_memory(node);
 
     return node;
 }
 
 static void free_node(Node *n) {
-    if (n == NULL) return;
-
     destroy_game(n->game_state);
-    destroy_move(n->move);
 
-    if (n->children != NULL) {
-        for (int i = 0; i < n->num_children; i++) {
-            free_node(n->children[i]);
+    destroy_list_of_moves(n->moves, n->num_children);
+    free(n->edges);
+    free(n->visit_counts);
+    free(n->values);
+    free(n->amaf_visit_counts);
+    free(n->amaf_win_counts);
+    free(n->priors);
+
+    free(n);
+}
+
+/*
+ * Finds the node of a position in the transposition table, or the slot to
+ * store it in. Returns NULL if the position is absent and its probe window
+ * is full, in which case the node is not shared.
+ */
+static Node **probe_table(Tree *t, uint64_t hash, Player player) {
+    for (int i = 0; i < MCTS_TABLE_PROBES; i++) {
+        Node **slot = &t->table[(hash + i) & (MCTS_TABLE_SIZE - 1)];
+        if (*slot == NULL ||
+            ((*slot)->hash == hash && (*slot)->player == player))
+            return slot;
+    }
+
+    return NULL;
+}
+
+/*
+ * Returns the node for the position g, reached by a move of player. With
+ * MCTS_TRANSPOSITIONS an existing node for the same position, or a symmetric
+ * one, is reused.
+ */
+static Node *get_node(Tree *t, Game *g, Player player) {
+    if (!MCTS_TRANSPOSITIONS) return create_node(t, g, player, 0);
+
+    int symmetry;
+    uint64_t hash = MCTS_SYMMETRIES && !MCTS_RAVE
+                        ? hash_canonical_state(g, &symmetry)
+                        : hash_game_state(g);
+    Node **slot = probe_table(t, hash, player);
+    if (slot != NULL && *slot != NULL) return *slot;
+
+    Node *node = create_node(t, g, player, hash);
+    if (slot != NULL) *slot = node;
+
+    return node;
+}
+
+/*
+ * Value of a child as stored in its parent's values array.
+ */
+static float child_value(Node *child) {
+    if (child->proof != UNPROVEN) return NO_VALUE;
+
+    return child->win_count / child->visit_count;
+}
+
+/*
+ * Returns the index of the largest values[i] + k / sqrt(visit_counts[i]),
+ * the first one on ties, or -1 if every value is NO_VALUE. This is UCB1 with
+ * k = C * sqrt(ln N) hoisted out of the loop. Only children with NO_VALUE can
+ * have no visits, so counts are clamped to 1 to keep the scores finite.
+ */
+static int argmax_ucb1(const float *values, const int *visit_counts, int n,
+                       float k) {
+    int best_child = -1;
+    float best_score = NO_VALUE;
+    int i = 0;
+
+#if defined(__AVX2__)
+    if (n >= 8) {
+        __m256 kv = _mm256_set1_ps(k);
+        __m256 best = _mm256_set1_ps(NO_VALUE);
+        __m256i best_index = _mm256_set1_epi32(-1);
+        __m256i index = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+        for (; i + 8 <= n; i += 8) {
+            __m256 visits = _mm256_max_ps(
+                _mm256_cvtepi32_ps(_mm256_loadu_si256(
+                    (const __m256i *)(visit_counts + i))),
+                _mm256_set1_ps(1.0f));
+            __m256 score =
+                _mm256_add_ps(_mm256_loadu_ps(values + i),
+                              _mm256_div_ps(kv, _mm256_sqrt_ps(visits)));
+            __m256 better = _mm256_cmp_ps(score, best, _CMP_GT_OQ);
+            best = _mm256_blendv_ps(best, score, better);
+            best_index = _mm256_blendv_epi8(best_index, index,
+                                            _mm256_castps_si256(better));
+            index = _mm256_add_epi32(index, _mm256_set1_epi32(8));
+        }
+
+        float lane_scores[8];
+        int lane_indices[8];
+        _mm256_storeu_ps(lane_scores, best);
+        _mm256_storeu_si256((__m256i *)lane_indices, best_index);
+        for (int lane = 0; lane < 8; lane++) {
+            if (lane_indices[lane] < 0) continue;
+            if (lane_scores[lane] > best_score ||
+                (lane_scores[lane] == best_score &&
+                 lane_indices[lane] < best_child)) {
+                best_score = lane_scores[lane];
+                best_child = lane_indices[lane];
+            }
         }
-        free(n->children);
     }
+#elif defined(__SSE2__)
+    if (n >= 4) {
+        __m128 kv = _mm_set1_ps(k);
+        __m128 best = _mm_set1_ps(NO_VALUE);
+        __m128i best_index = _mm_set1_epi32(-1);
+        __m128i index = _mm_setr_epi32(0, 1, 2, 3);
 
-    free(n);
+        for (; i + 4 <= n; i += 4) {
+            __m128 visits = _mm_max_ps(
+                _mm_cvtepi32_ps(
+                    _mm_loadu_si128((const __m128i *)(visit_counts + i))),
+                _mm_set1_ps(1.0f));
+            __m128 score = _mm_add_ps(_mm_loadu_ps(values + i),
+                                      _mm_div_ps(kv, _mm_sqrt_ps(visits)));
+            __m128 better = _mm_cmpgt_ps(score, best);
+            __m128i mask = _mm_castps_si128(better);
+            best = _mm_or_ps(_mm_and_ps(better, score),
+                             _mm_andnot_ps(better, best));
+            best_index = _mm_or_si128(_mm_and_si128(mask, index),
+                                      _mm_andnot_si128(mask, best_index));
+            index = _mm_add_epi32(index, _mm_set1_epi32(4));
+        }
+
+        float lane_scores[4];
+        int lane_indices[4];
+        _mm_storeu_ps(lane_scores, best);
+        _mm_storeu_si128((__m128i *)lane_indices, best_index);
+        for (int lane = 0; lane < 4; lane++) {
+            if (lane_indices[lane] < 0) continue;
+            if (lane_scores[lane] > best_score ||
+                (lane_scores[lane] == best_score &&
+                 lane_indices[lane] < best_child)) {
+                best_score = lane_scores[lane];
+                best_child = lane_indices[lane];
+            }
+        }
+    }
+#endif
+
+    for (; i < n; i++) {
+        int visits = visit_counts[i] > 0 ? visit_counts[i] : 1;
+        float score = values[i] + k / sqrtf(visits);
+        if (score > best_score) {
+            best_score = score;
+            best_child = i;
+        }
+    }
+
+    return best_child;
 }
 
-static double UCB1(double W, int N, int Nj, double C) {
-    return (W / N) + C * sqrt(log(N) / Nj);
+static double RAVE(Node *n, int i, double k) {
+    double amaf = n->amaf_win_counts[i] / n->amaf_visit_counts[i];
+
+    // An unvisited child is scored by its AMAF value alone, as if visited once
+    if (n->visit_counts[i] == 0) return amaf + k;
+
+    double exploration = k / sqrt(n->visit_counts[i]);
+
+    double beta = sqrt(RAVE_EQUIVALENCE /
+                       (3.0 * n->visit_counts[i] + RAVE_EQUIVALENCE));
+
+    return (1.0 - beta) * n->values[i] + beta * amaf + exploration;
 }
 
-static Node *select_best_child(Node *n) {
-    Node *best_child = NULL;
+/*
+ * With RAVE an unvisited child competes through its AMAF value, so every
+ * edge is scored, one at a time.
+ */
+static int select_best_child_rave(Node *n, int num_considered, double k) {
+    int best_child = -1;
     double best_score = -1.0;
 
-    for (int i = 0; i < n->num_children; i++) {
-        Node *child = n->children[i];
-        if (child->visit_count == 0) {
-            return child;
+    for (int i = 0; i < num_considered; i++) {
+        double score;
+
+        // Proven children need no more samples
+        Node *child = n->edges[i].child;
+        if (child != NULL && child->proof != UNPROVEN) continue;
+
+        if (n->amaf_visit_counts[i] > 0) {
+            score = RAVE(n, i, k);
+        } else if (n->visit_counts[i] == 0) {
+            return i;
+        } else {
+            score = n->values[i] + k / sqrt(n->visit_counts[i]);
+        }
+
+        if (score > best_score) {
+            best_score = score;
+            best_child = i;
         }
+    }
 
-        double score = UCB1(child->win_count, n->visit_count,
-                            child->visit_count, UCB1_CONSTANT);
+    return best_child;
+}
+
+/*
+ * Value of n for the player to move in it, as seen by its children.
+ */
+static double parent_value(Node *n) {
+    if (n->visit_count == 0) return REWARD_DRAW;
+
+    double value = n->win_count / n->visit_count;
+    return n->player == n->game_state->player_turn ? value : 1.0 - value;
+}
+
+static int select_best_child_puct(Node *n, int num_considered) {
+    int best_child = -1;
+    double best_score = -1.0;
+    double k = PUCT_CONSTANT * sqrt(n->visit_count);
+    double untried_value = parent_value(n);
+
+    for (int i = 0; i < num_considered; i++) {
+        Node *child = n->edges[i].child;
+        if (child != NULL && child->proof != UNPROVEN) continue;
+
+        double value = n->visit_counts[i] > 0 ? n->values[i] : untried_value;
+        double score = value + k * n->priors[i] / (1 + n->visit_counts[i]);
 
         if (score > best_score) {
             best_score = score;
-            best_child = child;
+            best_child = i;
         }
     }
 
     return best_child;
 }
 
-static Node *expand(Node *n) {
-    if (n->children == NULL) {
-        int num_moves = 0;
-        Move **moves = get_possible_moves(n->game_state, &num_moves);
+/*
+ * Number of moves of n that selection considers: all of them, or with
+ * MCTS_WIDENING a number growing with the visits of n.
+ */
+static int num_considered(Node *n) {
+    if (!MCTS_WIDENING) return n->num_children;
 
-        n->children = (Node **)malloc(sizeof(Node *) * num_moves);
-        n->num_children = num_moves;
+    int limit = (int)ceil(WIDENING_CONSTANT *
+                          pow(n->visit_count, WIDENING_EXPONENT));
+    if (limit < 1) return 1;
+    return limit < n->num_children ? limit : n->num_children;
+}
 
-        for (int i = 0; i < num_moves; i++) {
-            Game *game = copy_game_state(n->game_state);
-            make_move(game, moves[i]);
-            game->player_turn =
-                (game->player_turn == PLAYER1) ? PLAYER2 : PLAYER1;
-            n->children[i] = create_node(game, moves[i], n);
-            destroy_game(game);
+/*
+ * Returns the index of the edge to follow from n. Values come from the child
+ * nodes, which are shared between transpositions, while exploration uses
+ * the edge counts (UCT for DAGs). Edges are first tried in order; after that
+ * the UCB1 scores of all tried edges are computed together.
+ */
+static int select_best_child(Node *n) {
+    int limit = num_considered(n);
+    if (MCTS_PUCT) return select_best_child_puct(n, limit);
+
+    double k = UCB1_CONSTANT * sqrt(log(n->visit_count));
+
+    if (MCTS_RAVE) return select_best_child_rave(n, limit, k);
+
+    if (n->num_tried < limit) return n->num_tried++;
+
+    for (;;) {
+        int best_child = argmax_ucb1(n->values, n->visit_counts,
+                                     padded_size(n->num_children), k);
+
+        // Children proven through another parent are only noticed here
+        Node *child = best_child >= 0 ? n->edges[best_child].child : NULL;
+        if (child == NULL || child->proof == UNPROVEN) return best_child;
+        n->values[best_child] = NO_VALUE;
+    }
+}
+
+/*
+ * Tries to prove n from its children: n is decided once its player to move
+ * has a winning child or all of its children are proven. Returns true if n
+ * is proven.
+ */
+static bool update_proof(Node *n) {
+    Proof best = PROVEN_LOSS;
+    bool unproven = false;
+
+    for (int i = 0; i < n->num_children; i++) {
+        Node *child = n->edges[i].child;
+        Proof proof = child != NULL ? child->proof : UNPROVEN;
+        if (proof == PROVEN_WIN) {
+            best = PROVEN_WIN;
+            unproven = false;
+            break;
         }
+        if (proof == UNPROVEN) unproven = true;
+        if (proof > best) best = proof;
+    }
 
-        destroy_list_of_moves(moves, num_moves);
+    if (unproven) return false;
+
+    n->proof = n->player == n->game_state->player_turn ? best
+                                                       : invert_proof(best);
+    return true;
+}
+
+/*
+ * Sorts moves by decreasing get_move_prior(), keeping the order of
+ * get_possible_moves() between equal priors, and stores the sorted priors.
+ */
+static void sort_by_prior(Game *g, Move **moves, int *priors, int num_moves) {
+    for (int i = 0; i < num_moves; i++) {
+        Move *move = moves[i];
+        int prior = get_move_prior(g, move);
+
+        int j = i;
+        for (; j > 0 && priors[j - 1] < prior; j--) {
+            priors[j] = priors[j - 1];
+            moves[j] = moves[j - 1];
+        }
+        priors[j] = prior;
+        moves[j] = move;
+    }
+}
+
+/*
+ * Turns the sorted priors of n's moves into probabilities with a softmax.
+ */
+static void set_priors(Node *n, int *priors) {
+    double total = 0.0;
+
+    n->priors = (float *)malloc(sizeof(float) * n->num_children);
+    for (int i = 0; i < n->num_children; i++) {
+        n->priors[i] = exp((double)(priors[i] - priors[0]) / PRIOR_SCALE);
+        total += n->priors[i];
+    }
+    for (int i = 0; i < n->num_children; i++) n->priors[i] /= total;
+}
+
+/*
+ * Gives n its list of untried moves. Children are only created when their
+ * move is first tried, by create_child().
+ */
+static void expand(Tree *t, Node *n) {
+    int num_moves = 0;
+    Move **moves = get_possible_moves(n->game_state, &num_moves);
+    int *priors = NULL;
+    if (MCTS_PRIOR_ORDER || MCTS_PUCT || MCTS_WIDENING ||
+        MCTS_SEQUENTIAL_HALVING) {
+        priors = (int *)malloc(sizeof(int) * num_moves);
+        sort_by_prior(n->game_state, moves, priors, num_moves);
+    }
+
+    n->moves = moves;
+    n->edges = (Edge *)malloc(sizeof(Edge) * num_moves);
+    n->visit_counts = (int *)calloc(padded_size(num_moves), sizeof(int));
+    n->values = (float *)malloc(sizeof(float) * padded_size(num_moves));
+    for (int i = 0; i < padded_size(num_moves); i++) n->values[i] = NO_VALUE;
+    if (MCTS_RAVE) {
+        n->amaf_visit_counts = (int *)calloc(num_moves, sizeof(int));
+        n->amaf_win_counts = (float *)calloc(num_moves, sizeof(float));
+    }
+    n->num_children = num_moves;
+
+    for (int i = 0; i < num_moves; i++) {
+        n->edges[i].child = NULL;
+        n->edges[i].move_id = get_move_id(moves[i]);
+    }
+
+    if (MCTS_PUCT) set_priors(n, priors);
+    free(priors);
+
+    t->memory += expansion_memory(num_moves);
+}
+
+static void create_child(Tree *t, Node *n, int i) {
+    Game *game = copy_game_state(n->game_state);
+    bool done = make_move(game, n->moves[i]);
+    if (done)
+        game->player_turn = (game->player_turn == PLAYER1) ? PLAYER2 : PLAYER1;
+
+    Node *child = get_node(t, game, n->game_state->player_turn);
+    n->edges[i].child = child;
+
+    // A recycled child starts again from the statistics of its edge
+    if (child->visit_count == 0 && n->visit_counts[i] > 0 &&
+        n->values[i] != NO_VALUE) {
+        child->visit_count = n->visit_counts[i];
+        child->win_count = (double)n->values[i] * n->visit_counts[i];
+    }
+
+    destroy_game(game);
+}
+
+/*
+ * Sequential halving samples the remaining root moves in turn. Returns -1 if
+ * all of them are proven.
+ */
+static int select_next_arm(Tree *t) {
+    for (int i = 0; i < t->num_arms; i++) {
+        int edge = t->arms[t->next_arm];
+        t->next_arm = (t->next_arm + 1) % t->num_arms;
+
+        Node *child = t->root->edges[edge].child;
+        if (child == NULL || child->proof == UNPROVEN) return edge;
+    }
+
+    return -1;
+}
+
+/*
+ * Ends a round of sequential halving: keeps the better half of the root
+ * moves by mean reward. Untried and proven moves have NO_VALUE and go last.
+ */
+static void halve_arms(Tree *t) {
+    float *values = t->root->values;
+
+    for (int i = 1; i < t->num_arms; i++) {
+        int arm = t->arms[i];
+        int j = i;
+        for (; j > 0 && values[t->arms[j - 1]] < values[arm]; j--)
+            t->arms[j] = t->arms[j - 1];
+        t->arms[j] = arm;
+    }
+
+    t->num_arms = (t->num_arms + 1) / 2;
+    t->next_arm = 0;
+}
+
+static void push_path(Tree *t, Node *n, int edge) {
+    if (t->path_length == t->path_capacity) {
+        t->path_capacity *= 2;
+        t->path = (Node **)realloc(t->path, sizeof(Node *) * t->path_capacity);
+        t->path_edges =
+            (int *)realloc(t->path_edges, sizeof(int) * t->path_capacity);
     }
 
-    return select_best_child(n);
+    t->path[t->path_length] = n;
+    t->path_edges[t->path_length] = edge;
+    t->path_length++;
 }
 
-static double simulate(Node *n, Player p) {
+/*
+ * Descends from the root to the node to simulate from, recording the path.
+ * A leaf is expanded once it has been simulated from MCTS_EXPAND_THRESHOLD
+ * times, and every iteration creates at most one child. Proven nodes are
+ * returned as they are.
+ */
+static Node *select_leaf(Tree *t) {
+    Node *n = t->root;
+    t->path_length = 0;
+
+    while (n->proof == UNPROVEN) {
+        if (n->edges == NULL) {
+            if (n != t->root && n->visit_count < MCTS_EXPAND_THRESHOLD) break;
+
+            expand(t, n);
+        }
+
+        // Children proven through another parent can leave none to sample
+        int edge = MCTS_SEQUENTIAL_HALVING && n == t->root
+                       ? select_next_arm(t)
+                       : select_best_child(n);
+        if (edge < 0) {
+            update_proof(n);
+            break;
+        }
+
+        if (n->edges[edge].child == NULL) create_child(t, n, edge);
+
+        push_path(t, n, edge);
+        n = n->edges[edge].child;
+    }
+
+    push_path(t, n, -1);
+
+    return n;
+}
+
+/*
+ * Scores a position at the rollout depth limit for player p.
+ */
+static double evaluate_rollout(Game *game, Player p) {
+    double score = MCTS_EVALUATOR(game);
+    double win_probability = 1.0 / (1.0 + exp(-score / EVALUATION_SCALE));
+
+    return game->player_turn == p ? win_probability : 1.0 - win_probability;
+}
+
+/*
+ * Plays a random game from n, choosing uniformly among the game's rollout
+ * moves (or among all legal moves without MCTS_ROLLOUT_POLICY). When played
+ * is not NULL, every move is recorded in it as a bit mask of the players that
+ * played it (1 << player), for RAVE.
+ */
+static double simulate(Node *n, Player p, unsigned char *played) {
     Game *game = copy_game_state(n->game_state);
 
-    while (is_game_over(game) == GAME_NOT_FINISHED) {
+    for (int depth = 0; is_game_over(game) == GAME_NOT_FINISHED; depth++) {
+        if (MCTS_ROLLOUT_DEPTH > 0 && depth == MCTS_ROLLOUT_DEPTH) {
+            double reward = evaluate_rollout(game, p);
+            destroy_game(game);
+            return reward;
+        }
+
         int num_moves = 0;
-        Move **moves = get_possible_moves(game, &num_moves);
-        bool done = make_move(game, moves[rand() % num_moves]);
+        Move **moves = MCTS_ROLLOUT_POLICY
+                           ? get_rollout_moves(game, &num_moves)
+                           : get_possible_moves(game, &num_moves);
+        Move *move = moves[rand() % num_moves];
+        if (played != NULL)
+            played[get_move_id(move)] |= 1 << game->player_turn;
+        bool done = make_move(game, move);
         if (done)
             game->player_turn =
                 (game->player_turn == PLAYER1) ? PLAYER2 : PLAYER1;
@@ -128,36 +793,419 @@ static double simulate(Node *n, Player p) {
     }
 }
 
-static void backpropagate(Node *n, double reward) {
-    Node *current = n;
+/*
+ * Reward for player p of a proven node, used instead of a rollout.
+ */
+static double proven_reward(Node *n, Player p) {
+    double reward = n->proof == PROVEN_WIN    ? 1.0
+                    : n->proof == PROVEN_DRAW ? REWARD_DRAW
+                                              : 0.0;
+
+    return n->player == p ? reward : 1.0 - reward;
+}
+
+static void update_amaf(Node *n, double reward, Player p,
+                        unsigned char *played) {
+    Player player = n->game_state->player_turn;
+    unsigned char mask = 1 << player;
+
+    for (int i = 0; i < n->num_children; i++) {
+        if (played[n->edges[i].move_id] & mask) {
+            n->amaf_visit_counts[i]++;
+            n->amaf_win_counts[i] += player == p ? reward : 1.0 - reward;
+        }
+    }
+}
+
+/*
+ * Adds the reward (for player p) of one iteration to every node and edge on
+ * the path, each from the point of view of the player who moved into it, and
+ * propagates newly proven values upwards.
+ */
+static void backpropagate(Tree *t, Player p, double reward,
+                          unsigned char *played) {
+    bool proven = t->path[t->path_length - 1]->proof != UNPROVEN;
+
+    for (int i = t->path_length - 1; i >= 0; i--) {
+        Node *current = t->path[i];
+        int edge = t->path_edges[i];
 
-    while (current != NULL) {
         current->visit_count++;
-        current->win_count += reward;
-        current = current->parent;
+        current->win_count += current->player == p ? reward : 1.0 - reward;
+        if (edge >= 0) {
+            current->visit_counts[edge]++;
+            current->values[edge] = child_value(t->path[i + 1]);
+        }
+
+        if (proven && edge >= 0 && current->proof == UNPROVEN)
+            proven = update_proof(current);
+
+        if (played != NULL) {
+            update_amaf(current, reward, p, played);
+            if (edge >= 0)
+                played[current->edges[edge].move_id] |=
+                    1 << current->game_state->player_turn;
+        }
     }
 }
 
-Move *monte_carlo_tree_search(Game *g, Player p) {
-    Node *root = create_node(g, NULL, NULL);
+/*
+ * Whether root edge i is a better final choice than edge j. The moves kept by
+ * sequential halving have been sampled about equally, so they are compared
+ * by mean reward.
+ */
+static bool is_better_final_child(Node *root, int i, int j) {
+    if ((MCTS_FINAL_CHILD == MAX_CHILD || MCTS_SEQUENTIAL_HALVING) &&
+        root->visit_counts[i] > 0)
+        return root->values[i] > root->values[j];
+    return root->visit_counts[i] > root->visit_counts[j];
+}
+
+/*
+ * Returns the best unproven root edge among candidates (all edges if
+ * candidates is NULL), or -1 if they are all proven.
+ */
+static int best_unproven_child(Node *root, int *candidates,
+                               int num_candidates) {
+    int best_child = -1;
+
+    for (int j = 0; j < num_candidates; j++) {
+        int i = candidates != NULL ? candidates[j] : j;
+        Node *child = root->edges[i].child;
+        if (child != NULL && child->proof != UNPROVEN) continue;
+        if (best_child < 0 || is_better_final_child(root, i, best_child))
+            best_child = i;
+    }
+
+    return best_child;
+}
+
+/*
+ * Chooses the move to play: a proven win if there is one, otherwise the best
+ * unproven child by MCTS_FINAL_CHILD (among those sequential halving kept),
+ * unless a proven draw is worth more than it. When every move loses, the one
+ * with the best sampled value is played.
+ */
+static int select_final_child(Tree *t) {
+    Node *root = t->root;
+    int best_child = -1;
+    int draw_child = -1;
+
+    if (root->proof == UNPROVEN) update_proof(root);
+
+    for (int i = 0; i < root->num_children; i++) {
+        Node *child = root->edges[i].child;
+        if (child == NULL) continue;
+        if (child->proof == PROVEN_WIN) return i;
+        if (child->proof == PROVEN_DRAW) draw_child = i;
+    }
+
+    if (root->proof == UNPROVEN) {
+        if (MCTS_SEQUENTIAL_HALVING)
+            best_child = best_unproven_child(root, t->arms, t->num_arms);
+
+        // Sequential halving may have kept only moves proven since
+        if (best_child < 0)
+            best_child = best_unproven_child(root, NULL, root->num_children);
+
+        if (draw_child >= 0 && root->visit_counts[best_child] > 0 &&
+            root->values[best_child] < REWARD_DRAW)
+            best_child = draw_child;
+        return best_child;
+    }
+
+    if (draw_child >= 0) return draw_child;
+
+    for (int i = 0; i < root->num_children; i++) {
+        Node *child = root->edges[i].child;
+        Node *best = best_child >= 0 ? root->edges[best_child].child : NULL;
+        if (best == NULL || child->win_count * best->visit_count >
+                                best->win_count * child->visit_count)
+            best_child = i;
+    }
+
+    return best_child;
+}
+
+/*
+ * Whether the most visited unproven root move can no longer be overtaken in
+ * the given number of iterations.
+ */
+static bool is_decided(Node *root, double remaining_iterations) {
+    int first = 0, second = 0;
+
+    for (int i = 0; i < root->num_children; i++) {
+        Node *child = root->edges[i].child;
+        if (child != NULL && child->proof != UNPROVEN) continue;
+
+        int visits = root->visit_counts[i];
+        if (visits > first) {
+            second = first;
+            first = visits;
+        } else if (visits > second) {
+            second = visits;
+        }
+    }
+
+    return first - second > remaining_iterations;
+}
+
+static int compare_visits(const void *a, const void *b) {
+    return ((const NodeSize *)a)->visit_count -
+           ((const NodeSize *)b)->visit_count;
+}
+
+/*
+ * Marks the nodes reachable from n, detaching unproven children with at most
+ * cutoff visits from their parents.
+ */
+static void keep_reachable(Node *n, int cutoff) {
+    n->kept = true;
+    if (n->edges == NULL) return;
+
+    for (int i = 0; i < n->num_children; i++) {
+        Node *child = n->edges[i].child;
+        if (child == NULL || child->kept) continue;
+
+        if (child->proof == UNPROVEN && child->visit_count <= cutoff)
+            n->edges[i].child = NULL;
+        else
+            keep_reachable(child, cutoff);
+    }
+}
+
+/*
+ * Brings the memory of the tree down to about half of MCTS_MEMORY_LIMIT by
+ * freeing its least visited nodes. Unproven nodes with up to a cutoff number
+ * of visits are detached from their parents, whose edges keep the statistics
+ * of the move (see create_child()), and every node no longer reachable from
+ * the root is freed. Proven nodes are kept, as their parents' proofs depend
+ * on them. With glibc, the pages left free are then returned to the system,
+ * as the freed chunks are scattered over the heap and would otherwise stay
+ * resident.
+ */
+static void recycle_nodes(Tree *t) {
+    int num_nodes = 0;
+    for (Node *n = t->nodes; n != NULL; n = n->next) num_nodes++;
+
+    NodeSize *sizes = (NodeSize *)malloc(sizeof(NodeSize) * num_nodes);
+    int num_sizes = 0;
+    for (Node *n = t->nodes; n != NULL; n = n->next) {
+        if (n == t->root || n->proof != UNPROVEN) continue;
+        sizes[num_sizes].visit_count = n->visit_count;
+        sizes[num_sizes].memory = node_memory(n);
+        num_sizes++;
+    }
+    qsort(sizes, num_sizes, sizeof(NodeSize), compare_visits);
+
+    size_t excess = t->memory - MCTS_MEMORY_LIMIT / 2;
+    size_t freed = 0;
+    int cutoff = -1;
+    for (int i = 0; i < num_sizes && freed < excess; i++) {
+        freed += sizes[i].memory;
+        cutoff = sizes[i].visit_count;
+    }
+    free(sizes);
+
+    keep_reachable(t->root, cutoff);
+
+    Node **link = &t->nodes;
+    while (*link != NULL) {
+        Node *n = *link;
+        if (n->kept) {
+            n->kept = false;
+            link = &n->next;
+            continue;
+        }
+
+        *link = n->next;
+        t->memory -= node_memory(n);
+        free_node(n);
+    }
+
+    if (MCTS_TRANSPOSITIONS) {
+        memset(t->table, 0, sizeof(Node *) * MCTS_TABLE_SIZE);
+        for (Node *n = t->nodes; n != NULL; n = n->next) {
+            Node **slot = probe_table(t, n->hash, n->player);
+            if (slot != NULL) *slot = n;
+        }
+    }
+
+#if defined(__GLIBC__)
+    malloc_trim(0);
+#endif
+}
 
+static void free_tree(Tree *t) {
+    while (t->nodes != NULL) {
+        Node *next = t->nodes->next;
+        free_node(t->nodes);
+        t->nodes = next;
+    }
+
+    free(t->table);
+    free(t->path);
+    free(t->path_edges);
+    free(t->arms);
+}
+
+Move *monte_carlo_tree_search(Game *g, Player p) {
     clock_t start_time = clock();
-    for (int i = 0; i < MAX_ITERATIONS &&
-                    (clock() - start_time) / CLOCKS_PER_SEC < MOVE_TIME_LIMIT;
+#ifdef BOOK_FILE
+    int book_score;
+    Move *book_move = book_lookup(g, &book_score);
+    if (book_move != NULL) return book_move;
+#endif
+#if MCTS_THREAT_LENGTH > 0
+    Move *line[MCTS_THREAT_LENGTH];
+    int length = find_forced_win(g, true, MCTS_THREAT_LENGTH,
+                                 MOVE_TIME_LIMIT * 100, line);
+    if (length > 0) {
+        for (int i = 1; i < length; i++) destroy_move(line[i]);
+        return line[0];
+    }
+#endif
+    // Proofs do not tell how soon a win comes, the databases do
+    GameState solved_result;
+    int solved_length;
+    long long solved_nodes;
+    if (probe_endgame(g, &solved_result, &solved_length)) {
+        Move *solved = solve_position(g, &solved_result, &solved_length,
+                                      &solved_nodes);
+        if (solved != NULL) return solved;
+    }
+
+    Tree tree = {0};
+    tree.path_capacity = 64;
+    tree.path = (Node **)malloc(sizeof(Node *) * tree.path_capacity);
+    tree.path_edges = (int *)malloc(sizeof(int) * tree.path_capacity);
+    if (MCTS_TRANSPOSITIONS) {
+        tree.table = (Node **)calloc(MCTS_TABLE_SIZE, sizeof(Node *));
+        tree.memory += heap_size(sizeof(Node *) * MCTS_TABLE_SIZE);
+    }
+    measure_game_memory(g);
+    tree.root = get_node(&tree, g, g->player_turn == PLAYER1 ? PLAYER2
+                                                             : PLAYER1);
+    Node *root = tree.root;
+
+    int num_move_ids = get_num_move_ids();
+    unsigned char *played = MCTS_RAVE ? malloc(num_move_ids) : NULL;
+
+    // A single legal move needs no search
+    expand(&tree, root);
+    bool searching = root->num_children > 1;
+
+    int round = 0, num_rounds = 1;
+    if (MCTS_SEQUENTIAL_HALVING) {
+        tree.arms = (int *)malloc(sizeof(int) * root->num_children);
+        for (int i = 0; i < root->num_children; i++) tree.arms[i] = i;
+        tree.num_arms = root->num_children < HALVING_MOVES ? root->num_children
+                                                           : HALVING_MOVES;
+        while (1 << num_rounds < tree.num_arms) num_rounds++;
+    }
+
+    // Stop early once the root is proven: its best move is known
+    for (int i = 0; searching && i < MAX_ITERATIONS && root->proof == UNPROVEN;
          i++) {
-        Node *selected_child = expand(root);
-        double reward = simulate(selected_child, p);
-        backpropagate(selected_child, reward);
+        double elapsed = (double)(clock() - start_time) / CLOCKS_PER_SEC;
+        if (elapsed >= MOVE_TIME_LIMIT) break;
+
+        if (MCTS_EARLY_EXIT && MCTS_FINAL_CHILD == ROBUST_CHILD &&
+            !MCTS_SEQUENTIAL_HALVING && i % 64 == 0 && elapsed > 0) {
+            double remaining = (double)MAX_ITERATIONS - i;
+            double remaining_in_time = i / elapsed * (MOVE_TIME_LIMIT - elapsed);
+            if (remaining_in_time < remaining) remaining = remaining_in_time;
+            if (is_decided(root, remaining)) break;
+        }
+
+        if (MCTS_SEQUENTIAL_HALVING && tree.num_arms > 1 &&
+            (i >= (double)MAX_ITERATIONS * (round + 1) / num_rounds ||
+             elapsed >= (double)MOVE_TIME_LIMIT * (round + 1) / num_rounds)) {
+            halve_arms(&tree);
+            round++;
+        }
+
+        if (played != NULL) memset(played, 0, num_move_ids);
+
+        Node *leaf = select_leaf(&tree);
+        double reward = leaf->proof != UNPROVEN ? proven_reward(leaf, p)
+                                                : simulate(leaf, p, played);
+        backpropagate(&tree, p, reward, played);
+
+        if (tree.memory > MCTS_MEMORY_LIMIT) {
+            recycle_nodes(&tree);
+            // What is left is proven or among the most visited: stop here
+            if (tree.memory > MCTS_MEMORY_LIMIT / 4 * 3) break;
+        }
     }
 
-    Node *best_child = select_best_child(root);
-    Move *best_move = copy_move(best_child->move);
+    free(played);
 
-    free_node(root);
+    Move *best_move = copy_move(root->moves[select_final_child(&tree)]);
+
+    free_tree(&tree);
 
     return best_move;
 }
 
 Move *ai_make_move(Game *g) {
     return monte_carlo_tree_search(g, PLAYER2);
-}
\ No newline at end of file
+}
+
+#ifdef BUILD_BENCH
+/** Parents the benchmark cycles through, more than the caches hold. */
+#define BENCH_PARENTS 4096
+/** Children scored per run, whatever the number of children per parent. */
+#define BENCH_CHILDREN 200000000L
+
+/*
+ * Times UCB1 selections with argmax_ucb1(), as select_best_child() makes
+ * them, on parents with random statistics and a number of children given by
+ * each argument (by default 8, 9 and 144). Build with -mavx2, or with
+ * -U__SSE2__ for the scalar loop, to time the other versions of the argmax.
+ */
+int main(int argc, char **argv) {
+    static const int default_branching[] = {8, 9, 144};
+    int num_runs = argc > 1 ? argc - 1 : 3;
+#if defined(__AVX2__)
+    const char *version = "AVX2";
+#elif defined(__SSE2__)
+    const char *version = "SSE2";
+#else
+    const char *version = "scalar";
+#endif
+    srand(1);
+
+    for (int r = 0; r < num_runs; r++) {
+        int n = argc > 1 ? atoi(argv[r + 1]) : default_branching[r];
+        if (n <= 0) continue;
+        int padded = padded_size(n);
+        float *values = (float *)malloc(sizeof(float) * padded * BENCH_PARENTS);
+        int *visit_counts =
+            (int *)calloc((size_t)padded * BENCH_PARENTS, sizeof(int));
+        for (int i = 0; i < padded * BENCH_PARENTS; i++) {
+            values[i] = i % padded < n ? rand() / (float)RAND_MAX : NO_VALUE;
+            if (i % padded < n) visit_counts[i] = 1 + rand() % 100;
+        }
+
+        long selections = BENCH_CHILDREN / n;
+        long chosen = 0;
+        clock_t start = clock();
+        for (long s = 0; s < selections; s++) {
+            int p = s % BENCH_PARENTS;
+            float k = UCB1_CONSTANT * sqrt(log(1000 + s % 7));
+            chosen += argmax_ucb1(values + p * padded,
+                                  visit_counts + p * padded, padded, k);
+        }
+        double elapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+        // The sum of the children chosen keeps the loop from being dropped
+        printf("%s, branching %d: %.1fM selections/s (%ld)\n", version, n,
+               elapsed > 0 ? selections / elapsed / 1e6 : 0.0, chosen % 10);
+        free(values);
+        free(visit_counts);
+    }
+
+    return 0;
+}
+#endif
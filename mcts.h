@@ -3,9 +3,174 @@
 
 #include "game.h"
 
+#ifndef MAX_ITERATIONS
 #define MAX_ITERATIONS 10000000
-#define UCB1_CONSTANT 1.414
+#endif
+#ifndef UCB1_CONSTANT
+#define UCB1_CONSTANT 0.5
+#endif
 #define REWARD_DRAW 0.5
 
+/**
+ * How the move to play is chosen among the root's children: the most visited
+ * one (ROBUST_CHILD) or the one with the highest mean reward (MAX_CHILD).
+ * Proven wins and draws take precedence either way.
+ */
+#define ROBUST_CHILD 0
+#define MAX_CHILD 1
+#ifndef MCTS_FINAL_CHILD
+#define MCTS_FINAL_CHILD ROBUST_CHILD
+#endif
+
+/**
+ * Stops the search once the most visited root move leads the second one by
+ * more visits than the remaining iterations (up to MAX_ITERATIONS, or at the
+ * current rate until MOVE_TIME_LIMIT) could add, as playing the most visited
+ * move is then decided. Only used with ROBUST_CHILD and without sequential
+ * halving.
+ */
+#ifndef MCTS_EARLY_EXIT
+#define MCTS_EARLY_EXIT 1
+#endif
+
+/**
+ * Sequential halving at the root: the HALVING_MOVES root moves with the
+ * highest get_move_prior() are kept, and the MAX_ITERATIONS / MOVE_TIME_LIMIT
+ * budget is split into ceil(log2(moves)) rounds in which the remaining moves
+ * are sampled in turn. Each round drops the worse half of them by mean
+ * reward. Deeper nodes still use the usual selection. The remaining moves are
+ * sampled about equally, so the one with the best mean is played.
+ */
+#ifndef MCTS_SEQUENTIAL_HALVING
+#define MCTS_SEQUENTIAL_HALVING 0
+#endif
+#ifndef HALVING_MOVES
+#define HALVING_MOVES 16
+#endif
+
+/**
+ * Number of rollouts played from a leaf before it is expanded (at least 1).
+ * Higher values keep the tree (one game copy per node) smaller on wide games.
+ */
+#ifndef MCTS_EXPAND_THRESHOLD
+#define MCTS_EXPAND_THRESHOLD 4
+#endif
+
+/**
+ * Untried moves of a node are tried in decreasing order of get_move_prior()
+ * instead of the order of get_possible_moves().
+ */
+#ifndef MCTS_PRIOR_ORDER
+#define MCTS_PRIOR_ORDER 0
+#endif
+
+/**
+ * PUCT selection: children are scored Q + PUCT_CONSTANT * P * sqrt(N) /
+ * (1 + Nj), where P is the softmax of get_move_prior() over the node's moves.
+ * Untried children take the value of their parent as Q. Replaces UCB1 and
+ * RAVE.
+ */
+#ifndef MCTS_PUCT
+#define MCTS_PUCT 0
+#endif
+#ifndef PUCT_CONSTANT
+#define PUCT_CONSTANT 1.0
+#endif
+
+/**
+ * Progressive widening: a node with N visits only considers its
+ * ceil(WIDENING_CONSTANT * N^WIDENING_EXPONENT) moves with the highest prior.
+ */
+#ifndef MCTS_WIDENING
+#define MCTS_WIDENING 0
+#endif
+#ifndef WIDENING_CONSTANT
+#define WIDENING_CONSTANT 2.0
+#endif
+#ifndef WIDENING_EXPONENT
+#define WIDENING_EXPONENT 0.5
+#endif
+
+/**
+ * With MCTS_TRANSPOSITIONS, positions reached through different move orders
+ * share one node, found by hash_game_state() in a table of MCTS_TABLE_SIZE
+ * (a power of two) entries. A position whose MCTS_TABLE_PROBES slots are all
+ * taken gets a node of its own.
+ */
+#ifndef MCTS_TRANSPOSITIONS
+#define MCTS_TRANSPOSITIONS 0
+#endif
+#ifndef MCTS_TABLE_SIZE
+#define MCTS_TABLE_SIZE (1 << 20)
+#endif
+#ifndef MCTS_TABLE_PROBES
+#define MCTS_TABLE_PROBES 4
+#endif
+
+/**
+ * With MCTS_TRANSPOSITIONS, positions that a symmetry of the board maps onto
+ * each other share one node too, found by hash_canonical_state(). A shared
+ * node keeps the moves of the position it was created for, so the AMAF
+ * statistics of MCTS_RAVE, kept by move identifier along the path, would mix
+ * symmetric moves: with MCTS_RAVE only equal positions are shared.
+ */
+#ifndef MCTS_SYMMETRIES
+#define MCTS_SYMMETRIES 1
+#endif
+
+/**
+ * Upper bound in bytes on the heap memory of the search tree, including the
+ * transposition table. When it is reached, the least visited nodes are freed
+ * until the tree is back to half of it, and the search goes on from what is
+ * left. Game copies and move lists are sized once per process with glibc's
+ * mallinfo2(), and guessed on other C libraries.
+ */
+#ifndef MCTS_MEMORY_LIMIT
+#define MCTS_MEMORY_LIMIT ((size_t)1 << 30)
+#endif
+
+/**
+ * Rollouts pick from get_rollout_moves() instead of every legal move, letting
+ * the game restrict playouts to plausible moves.
+ */
+#ifndef MCTS_ROLLOUT_POLICY
+#define MCTS_ROLLOUT_POLICY 1
+#endif
+
+/**
+ * Rollouts stop after MCTS_ROLLOUT_DEPTH moves (0 plays them to the end) and
+ * the position is scored by MCTS_EVALUATOR, a function with the signature of
+ * evaluate() from ai.h, turned into a win probability for the player to move
+ * by 1 / (1 + exp(-score / EVALUATION_SCALE)).
+ */
+#ifndef MCTS_ROLLOUT_DEPTH
+#define MCTS_ROLLOUT_DEPTH 0
+#endif
+#ifndef MCTS_EVALUATOR
+#define MCTS_EVALUATOR evaluate
+#endif
+
+/**
+ * RAVE (all-moves-as-first) statistics. When enabled, every move played by a
+ * node's player later in an iteration also updates that move's AMAF value,
+ * which is blended into the UCB1 score with weight
+ * beta = sqrt(k / (3 * visits + k)), k = RAVE_EQUIVALENCE.
+ */
+#ifndef MCTS_RAVE
+#define MCTS_RAVE 0
+#endif
+#ifndef RAVE_EQUIVALENCE
+#define RAVE_EQUIVALENCE 1000
+#endif
+
+/**
+ * Longest forced win, in moves of both players, that a threat-space search
+ * (find_forced_win) looks for before each search, within a tenth of
+ * MOVE_TIME_LIMIT. A win found is played without searching. 0 skips it.
+ */
+#ifndef MCTS_THREAT_LENGTH
+#define MCTS_THREAT_LENGTH 25
+#endif
+
 Move* monte_carlo_tree_search(Game* g, Player p);
 #endif
\ No newline at end of file
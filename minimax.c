@@ -1,145 +1,843 @@
 #include "minimax.h"
 
-#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "ai.h"
+#ifdef BOOK_FILE
+#include "book.h"
+#endif
 #include "game.h"
 
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 
-typedef struct Node {
-    Game *game_state;
-    Move *move;
-    struct Node *parent;
-    struct Node **children;
-    int num_children;
-    double score;
-} Node;
+/**
+ * Bound above every score, for the initial alpha-beta window.
+ */
+#define INFINITE_SCORE (MINIMAX_REWARD_WIN + 1)
+
+/**
+ * Static evaluations are clamped below this, so that they always rank
+ * between forced wins and forced losses.
+ */
+#define MAX_EVALUATION (MINIMAX_REWARD_WIN / 2)
+
+/**
+ * The clock is read once every this many nodes (a power of two).
+ */
+#define TIME_CHECK_INTERVAL 1024
+
+/**
+ * Depth stored for positions whose search reached the end of the game on
+ * every line, which are exact at any depth.
+ */
+#define FULL_DEPTH UINT8_MAX
+
+/**
+ * What a stored score says about the position: it is exact, or the search
+ * failed high (the true score is at least this) or low (at most this).
+ */
+typedef enum {
+    BOUND_EXACT,
+    BOUND_LOWER,
+    BOUND_UPPER,
+} Bound;
+
+/**
+ * A transposition table entry. Scores of wins and losses are stored relative
+ * to the position rather than to the root, so that they stay valid when the
+ * position is reached at another ply.
+ */
+typedef struct Entry {
+    int16_t score;
+    int16_t best_move; /** Move id of the best move, or -1. */
+    uint8_t depth;
+    uint8_t bound;
+    uint8_t generation; /** Search that stored the entry. */
+} Entry;
+
+/**
+ * A slot of the transposition table, shared by all the search threads
+ * without locks. The entry is packed into one word, and the key is the hash
+ * of the position xor that word: a slot written by two threads at once ends
+ * up with the key of one and the data of the other, and is then not found.
+ */
+typedef struct Slot {
+    _Atomic uint64_t key;
+    _Atomic uint64_t data;
+} Slot;
+
+static Slot *table;
+static size_t table_size = MINIMAX_TABLE_SIZE;
+static bool table_allocated;
+static uint8_t generation;
+
+/**
+ * State of one search thread: when the search started, how many nodes it
+ * visited, whether it ran out of time and whether the current iteration was
+ * cut short by its depth anywhere (if not, its score is exact). The positions
+ * being searched are kept in a stack with one game per level of recursion,
+ * copied into with copy_game_state_into(), so the search allocates no memory
+ * per node besides the move lists of the positions on the current line.
+ * Threads only share the root moves, the transposition table and the flag
+ * that stops them all.
+ */
+typedef struct Search {
+    int id; /** 0 for the main thread, whose time checks stop the others. */
+    struct timespec start;
+    long long nodes;
+    long long quiescence_nodes; /** Nodes beyond the depth limit. */
+    atomic_bool *stop;
+    bool stopped;
+    bool depth_limited;
+    long long probes; /** Transposition table lookups. */
+    long long hits;   /** Lookups that found the position. */
+    long long cutoffs; /** Hits that made a search unnecessary. */
+    long long researches; /** Null window searches that had to be redone. */
+    long long fails_high; /** Iterations that scored above their window. */
+    long long fails_low;  /** Iterations that scored below their window. */
+    Game **positions;
+    int num_positions;
+    /** Ids of the last two moves that caused a beta cutoff at each ply. */
+    int killers[MINIMAX_MAX_DEPTH + 1][2];
+    /** Sum of depth * depth over the cutoffs of each move id, per player. */
+    int64_t *history[2];
+    Move **moves;  /** Moves of the root. */
+    int *order;    /** Indices of the root moves, best first. */
+    int num_moves;
+    int best_move; /** Index of the best root move of the last iteration. */
+    int best_score;
+    int depth_reached; /** Depth of the last completed iteration. */
+} Search;
+
+/*
+ * Returns the game for the given level of recursion, allocating the levels
+ * up to it the first time they are reached. Checkers multi-jumps take a level
+ * but not a ply, so the number of levels is not known in advance.
+ */
+static Game *get_position(Search *s, int level) {
+    if (level >= s->num_positions) {
+        int capacity = MAX(2 * s->num_positions, level + 1);
+        s->positions =
+            (Game **)realloc(s->positions, sizeof(Game *) * capacity);
+        for (int i = s->num_positions; i < capacity; i++)
+            s->positions[i] = copy_game_state(s->positions[0]);
+        s->num_positions = capacity;
+    }
 
-static Node *create_node(Game *g, Move *m, Node *parent) {
-    Node *node = (Node *)malloc(sizeof(Node));
+    return s->positions[level];
+}
 
-    node->game_state = copy_game_state(g);
-    node->move = copy_move(m);
-    node->parent = parent;
-    node->children = NULL;
-    node->num_children = 0;
-    node->score = 0.0;
+static double elapsed_ms(Search *s) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
 
-    return node;
+    return (now.tv_sec - s->start.tv_sec) * 1000.0 +
+           (now.tv_nsec - s->start.tv_nsec) / 1000000.0;
 }
 
-static void free_node(Node *n) {
-    if (n == NULL) return;
+/*
+ * Score of a finished game for the player to move, ply moves from the root.
+ */
+static int terminal_score(GameState result, Player player, int ply) {
+    if (result == GAME_DRAWN) return MINIMAX_REWARD_DRAW;
 
-    destroy_game(n->game_state);
-    destroy_move(n->move);
+    Player winner = result == GAME_WON_BY_PLAYER1 ? PLAYER1 : PLAYER2;
+    return winner == player ? MINIMAX_REWARD_WIN - ply
+                            : MINIMAX_REWARD_LOSE + ply;
+}
 
-    if (n->children != NULL) {
-        for (int i = 0; i < n->num_children; i++) {
-            free_node(n->children[i]);
-        }
-        free(n->children);
+static bool is_decisive(int score) {
+    return score >= MINIMAX_REWARD_WIN - MINIMAX_MAX_DEPTH ||
+           score <= MINIMAX_REWARD_LOSE + MINIMAX_MAX_DEPTH;
+}
+
+void minimax_set_table_size(size_t num_entries) {
+    size_t size = 1;
+    while (size * 2 <= num_entries) size *= 2;
+
+    free(table);
+    table = NULL;
+    table_size = num_entries > 0 ? size : 0;
+    table_allocated = false;
+}
+
+/*
+ * Allocates the table the first time it is needed, with the number of entries
+ * of the MINIMAX_TABLE_SIZE environment variable if it is set.
+ */
+static void init_table() {
+    static bool size_read = false;
+    if (!size_read) {
+        size_read = true;
+        const char *size = getenv("MINIMAX_TABLE_SIZE");
+        if (size != NULL) minimax_set_table_size(strtoull(size, NULL, 0));
     }
+    if (table_allocated) return;
 
-    free(n);
+    table_allocated = true;
+    if (table_size >= 2) table = (Slot *)calloc(table_size, sizeof(Slot));
 }
 
-static Node *select_best_child(Node *n, bool maximizing_player) {
-    Node *best_child = NULL;
-    double best_score = (maximizing_player) ? INT_MIN : INT_MAX;
+static uint64_t pack_entry(Entry entry) {
+    return (uint64_t)(uint16_t)entry.score |
+           (uint64_t)(uint16_t)entry.best_move << 16 |
+           (uint64_t)entry.depth << 32 | (uint64_t)entry.bound << 40 |
+           (uint64_t)entry.generation << 48;
+}
 
-    for (int i = 0; i < n->num_children; i++) {
-        Node *child = n->children[i];
-        if (maximizing_player) {
-            if (child->score > best_score) {
-                best_score = child->score;
-                best_child = child;
-            }
-        } else {
-            if (child->score < best_score) {
-                best_score = child->score;
-                best_child = child;
-            }
+static Entry unpack_entry(uint64_t data) {
+    Entry entry;
+    entry.score = (int16_t)(data & 0xFFFF);
+    entry.best_move = (int16_t)(data >> 16 & 0xFFFF);
+    entry.depth = data >> 32 & 0xFF;
+    entry.bound = data >> 40 & 0xFF;
+    entry.generation = data >> 48 & 0xFF;
+
+    return entry;
+}
+
+/*
+ * Copies the entry for the position into entry. Returns false if it is not
+ * stored. Entries of depth 0 are empty slots.
+ */
+static bool probe_table(Search *s, uint64_t hash, Entry *entry) {
+    s->probes++;
+
+    Slot *bucket = &table[hash & (table_size - 2)];
+    for (int i = 0; i < 2; i++) {
+        uint64_t key = atomic_load_explicit(&bucket[i].key,
+                                            memory_order_relaxed);
+        uint64_t data = atomic_load_explicit(&bucket[i].data,
+                                             memory_order_relaxed);
+        if ((key ^ data) == hash && (data >> 32 & 0xFF) > 0) {
+            s->hits++;
+            *entry = unpack_entry(data);
+            return true;
         }
     }
 
-    return best_child;
+    return false;
 }
 
-static void simulate(Node *n, bool maximizing_player) {
-    GameState result = is_game_over(n->game_state);
+/*
+ * Stores the result of a search of the position at the given ply. The first
+ * entry of a bucket is replaced by searches at least as deep and by those of
+ * a newer move; the others go to the second entry, which always takes them.
+ */
+static void store_table(uint64_t hash, int depth, int ply, int score,
+                        Bound bound, int best_move) {
+    Slot *bucket = &table[hash & (table_size - 2)];
+    uint64_t first_key =
+        atomic_load_explicit(&bucket[0].key, memory_order_relaxed);
+    uint64_t first_data =
+        atomic_load_explicit(&bucket[0].data, memory_order_relaxed);
+    Entry first = unpack_entry(first_data);
+    Slot *slot = &bucket[1];
+    if ((first_key ^ first_data) == hash || depth >= first.depth ||
+        first.generation != generation)
+        slot = &bucket[0];
+
+    if (score >= MINIMAX_REWARD_WIN - MINIMAX_MAX_DEPTH) score += ply;
+    if (score <= MINIMAX_REWARD_LOSE + MINIMAX_MAX_DEPTH) score -= ply;
+
+    Entry entry = {score, best_move, depth, bound, generation};
+    uint64_t data = pack_entry(entry);
+    atomic_store_explicit(&slot->key, hash ^ data, memory_order_relaxed);
+    atomic_store_explicit(&slot->data, data, memory_order_relaxed);
+}
 
-    switch (result) {
-        case GAME_WON_BY_PLAYER1:
-            n->score = MINIMAX_REWARD_LOSE;
-            return;
+/*
+ * Score of an entry for a position at the given ply.
+ */
+static int entry_score(Entry *entry, int ply) {
+    int score = entry->score;
+    if (score >= MINIMAX_REWARD_WIN - MINIMAX_MAX_DEPTH) return score - ply;
+    if (score <= MINIMAX_REWARD_LOSE + MINIMAX_MAX_DEPTH) return score + ply;
 
-        case GAME_WON_BY_PLAYER2:
-            n->score = MINIMAX_REWARD_WIN;
-            return;
+    return score;
+}
 
-        case GAME_DRAWN:
-            n->score = MINIMAX_REWARD_DRAW;
-            return;
+/*
+ * Key by which moves are searched, highest first: the best move stored in the
+ * transposition table, then the killer moves of the ply, then the others by
+ * how often they caused cutoffs (the history heuristic) and, between equals,
+ * by get_move_prior(), the game's static ordering.
+ */
+static int64_t move_order(Search *s, Game *g, Move *m, int table_move,
+                          int ply) {
+    int id = get_move_id(m);
+    if (id == table_move) return INT64_MAX;
+    if (id == s->killers[ply][0]) return INT64_MAX - 1;
+    if (id == s->killers[ply][1]) return INT64_MAX - 2;
+
+    // Priors are far below 2^16, so they only order moves of equal history
+    return (s->history[g->player_turn][id] << 16) + get_move_prior(g, m);
+}
 
-        default:
-            break;
+/*
+ * Records that move m caused a beta cutoff with the given remaining depth.
+ */
+static void update_order(Search *s, Game *g, Move *m, int depth, int ply) {
+    int id = get_move_id(m);
+    if (id != s->killers[ply][0]) {
+        s->killers[ply][1] = s->killers[ply][0];
+        s->killers[ply][0] = id;
     }
+    s->history[g->player_turn][id] += depth * depth;
+}
+
+static int negamax(Search *s, int level, int depth, int ply, int alpha,
+                   int beta);
+
+/*
+ * Searches the position at the given level, reached by a move from the one
+ * above, and returns its score for the player who made the move. done tells
+ * whether that move ended the player's turn: if not (a checkers multi-jump),
+ * the same player moves again within the same ply.
+ */
+static int search_child(Search *s, int level, bool done, int depth, int ply,
+                        int alpha, int beta) {
+    if (done) return -negamax(s, level, depth - 1, ply + 1, -beta, -alpha);
+
+    return negamax(s, level, depth, ply, alpha, beta);
+}
+
+/*
+ * Principal variation search of a move other than the first: as the first
+ * move is expected to be the best, the others are only searched with a null
+ * window (alpha, alpha + 1), which proves cheaply that they are no better,
+ * and searched again with the full window when one turns out to be.
+ */
+static int search_later_child(Search *s, int level, bool done, int depth,
+                              int ply, int alpha, int beta) {
+#if MINIMAX_PVS
+    int score = search_child(s, level, done, depth, ply, alpha, alpha + 1);
+    if (score <= alpha || score >= beta || s->stopped) return score;
+
+    s->researches++;
+#endif
+    return search_child(s, level, done, depth, ply, alpha, beta);
+}
+
+/*
+ * Counts a node, and returns whether the search has to stop, having run out
+ * of time or been stopped by the main thread.
+ */
+static bool count_node(Search *s) {
+    s->nodes++;
+    if (s->nodes % TIME_CHECK_INTERVAL == 0 &&
+        elapsed_ms(s) >= MINIMAX_TIME_LIMIT_MS)
+        atomic_store(s->stop, true);
+    if (s->stopped || atomic_load_explicit(s->stop, memory_order_relaxed))
+        s->stopped = true;
+
+    return s->stopped;
+}
+
+static int evaluate_leaf(Game *g) {
+    return MAX(-MAX_EVALUATION, MIN(evaluate(g), MAX_EVALUATION));
+}
+
+/*
+ * Quiescence search of a position at or beyond the depth limit, which is not
+ * over: the player to move either stands on the static evaluation or
+ * captures, up to depth more captures deep. A capture after which the same
+ * player moves again (a checkers multi-jump) continues the same ply.
+ */
+static int quiesce(Search *s, int level, int depth, int ply, int alpha,
+                   int beta) {
+    Game *g = s->positions[level];
+    int best_score = evaluate_leaf(g);
+    if (depth == 0 || best_score >= beta) return best_score;
+    alpha = MAX(alpha, best_score);
 
     int num_moves = 0;
-    Move **moves = get_possible_moves(n->game_state, &num_moves);
+    Move **moves = get_capture_moves(g, &num_moves);
+    Game *child = num_moves > 0 ? get_position(s, level + 1) : NULL;
+    for (int i = 0; i < num_moves; i++) {
+        if (count_node(s)) break;
+        s->quiescence_nodes++;
+
+        copy_game_state_into(child, g);
+        bool done = make_move(child, moves[i]);
+        if (done)
+            child->player_turn =
+                (g->player_turn == PLAYER1) ? PLAYER2 : PLAYER1;
+
+        int score;
+        GameState result = is_game_over(child);
+        if (result != GAME_NOT_FINISHED)
+            score = terminal_score(result, g->player_turn,
+                                   done ? ply + 1 : ply);
+        else if (done)
+            score = -quiesce(s, level + 1, depth - 1, ply + 1, -beta, -alpha);
+        else
+            score = quiesce(s, level + 1, depth - 1, ply, alpha, beta);
+        if (s->stopped) break;
+
+        best_score = MAX(best_score, score);
+        alpha = MAX(alpha, score);
+        if (alpha >= beta) break;
+    }
+    destroy_list_of_moves(moves, num_moves);
 
-    n->num_children = num_moves;
-    n->children = (Node **)malloc(sizeof(Node *) * num_moves);
+    return best_score;
+}
 
-    // Initialize node score based on the player type
-    if (maximizing_player) {
-        n->score = INT_MIN;
-    } else {
-        n->score = INT_MAX;
+/*
+ * Alpha-beta negamax: returns the score of the position at the given level
+ * for its player to move, searched depth moves deep. Scores outside
+ * (alpha, beta) are only bounds. A move after which the same player moves
+ * again (a checkers multi-jump) continues the same ply. Positions are looked
+ * up in and stored to the transposition table, except at the depth limit,
+ * and positions of the endgame databases are scored without searching.
+ */
+static int negamax(Search *s, int level, int depth, int ply, int alpha,
+                   int beta) {
+    if (count_node(s)) return 0;
+
+    Game *g = s->positions[level];
+    GameState result = is_game_over(g);
+    if (result != GAME_NOT_FINISHED)
+        return terminal_score(result, g->player_turn, ply);
+
+    int length;
+    if (probe_endgame(g, &result, &length))
+        return terminal_score(result, g->player_turn,
+                              MIN(ply + length, MINIMAX_MAX_DEPTH));
+
+    if (depth == 0) {
+        if (MINIMAX_LEAF_THREAT_LENGTH > 0) {
+            int length =
+                find_forced_win(g, false, MINIMAX_LEAF_THREAT_LENGTH, 0, NULL);
+            if (length > 0) return MINIMAX_REWARD_WIN - (ply + length);
+        }
+
+        s->depth_limited = true;
+        return quiesce(s, level, MINIMAX_QUIESCENCE_DEPTH, ply, alpha, beta);
+    }
+
+    uint64_t hash = 0;
+    int symmetry = 0;
+    int table_move = -1;
+    if (table != NULL) {
+        hash = MINIMAX_SYMMETRIES ? hash_canonical_state(g, &symmetry)
+                                  : hash_game_state(g);
+        Entry entry;
+        bool found = probe_table(s, hash, &entry);
+        if (found && entry.best_move >= 0)
+            table_move = transform_move_id(entry.best_move, symmetry, true);
+        if (found && entry.depth >= depth) {
+            int score = entry_score(&entry, ply);
+            if (entry.bound == BOUND_EXACT ||
+                (entry.bound == BOUND_LOWER && score >= beta) ||
+                (entry.bound == BOUND_UPPER && score <= alpha)) {
+                s->cutoffs++;
+                if (entry.depth != FULL_DEPTH) s->depth_limited = true;
+                return score;
+            }
+        }
     }
 
+    // Whether this subtree is cut by depth is tracked apart from the rest
+    bool depth_limited = s->depth_limited;
+    s->depth_limited = false;
+
+    int num_moves = 0;
+    Move **moves = get_possible_moves(g, &num_moves);
+    Game *child = get_position(s, level + 1);
+
+    int64_t order[num_moves];
+    for (int i = 0; i < num_moves; i++)
+        order[i] = move_order(s, g, moves[i], table_move, ply);
+
+    int original_alpha = alpha;
+    int best_score = -INFINITE_SCORE;
+    int best_move = 0;
     for (int i = 0; i < num_moves; i++) {
-        Game *game = copy_game_state(n->game_state);
-        bool done = make_move(game, moves[i]);
+        // Moves are sorted as they are needed, as a cutoff often comes early
+        int next = i;
+        for (int j = i + 1; j < num_moves; j++)
+            if (order[j] > order[next]) next = j;
+        int64_t key = order[next];
+        Move *move = moves[next];
+        order[next] = order[i];
+        moves[next] = moves[i];
+        order[i] = key;
+        moves[i] = move;
+
+        copy_game_state_into(child, g);
+        bool done = make_move(child, moves[i]);
         if (done)
-            game->player_turn =
-                (game->player_turn == PLAYER1) ? PLAYER2 : PLAYER1;
+            child->player_turn =
+                (g->player_turn == PLAYER1) ? PLAYER2 : PLAYER1;
+        int score =
+            i == 0
+                ? search_child(s, level + 1, done, depth, ply, alpha, beta)
+                : search_later_child(s, level + 1, done, depth, ply, alpha,
+                                     beta);
+        if (s->stopped) break;
+
+        if (score > best_score) {
+            best_score = score;
+            best_move = i;
+        }
+        alpha = MAX(alpha, score);
+        if (alpha >= beta) {
+            update_order(s, g, moves[i], depth, ply);
+            break;
+        }
+    }
+
+    if (table != NULL && !s->stopped) {
+        Bound bound = best_score <= original_alpha ? BOUND_UPPER
+                      : best_score >= beta         ? BOUND_LOWER
+                                                   : BOUND_EXACT;
+        store_table(hash, s->depth_limited ? depth : FULL_DEPTH, ply,
+                    best_score, bound,
+                    transform_move_id(get_move_id(moves[best_move]),
+                                      symmetry, false));
+    }
+    s->depth_limited |= depth_limited;
 
-        Node *child = create_node(game, moves[i], n);
-        n->children[i] = child;
-        simulate(child, !maximizing_player);
+    destroy_list_of_moves(moves, num_moves);
+
+    return best_score;
+}
 
-        if (maximizing_player) {
-            n->score = MAX(n->score, child->score);
-            if (n->score == 1.0) break;
+/*
+ * Searches the root moves in the thread's order to the given depth, within
+ * the window (alpha, beta). Returns the index of the best one and stores its
+ * score, which is only a bound if it falls outside the window.
+ */
+static int search_root(Search *s, int depth, int alpha, int beta,
+                       int *best_score) {
+    Game *g = s->positions[0];
+    Game *child = get_position(s, 1);
+
+    int best_move = s->order[0];
+    int best = -INFINITE_SCORE;
+    for (int i = 0; i < s->num_moves; i++) {
+        copy_game_state_into(child, g);
+        bool done = make_move(child, s->moves[s->order[i]]);
+        if (done)
+            child->player_turn =
+                (g->player_turn == PLAYER1) ? PLAYER2 : PLAYER1;
+        int score =
+            i == 0 ? search_child(s, 1, done, depth, 0, alpha, beta)
+                   : search_later_child(s, 1, done, depth, 0, alpha, beta);
+        if (s->stopped) break;
+
+        if (score > best) {
+            best = score;
+            best_move = s->order[i];
+        }
+        alpha = MAX(alpha, score);
+        if (alpha >= beta) break;
+    }
+
+    *best_score = best;
+    return best_move;
+}
+
+/*
+ * Runs one iteration of iterative deepening and moves its best move to the
+ * front of the order. Returns false if it ran out of time, in which case it
+ * is discarded. The iteration is first searched within an aspiration window
+ * around the score of the previous one; if its score falls outside, the
+ * window is widened on that side, twice as much each time, and the search
+ * is repeated.
+ */
+static bool iterate(Search *s, int depth) {
+    int window = MINIMAX_ASPIRATION_WINDOW;
+    int alpha = -INFINITE_SCORE;
+    int beta = INFINITE_SCORE;
+    if (window > 0 && s->depth_reached > 0 && !is_decisive(s->best_score)) {
+        alpha = s->best_score - window;
+        beta = s->best_score + window;
+    }
+
+    int score;
+    int move;
+    while (true) {
+        s->depth_limited = false;
+        move = search_root(s, depth, alpha, beta, &score);
+        if (s->stopped) return false;
+
+        if (score <= alpha) {
+            s->fails_low++;
+            alpha = MAX(score - window, -INFINITE_SCORE);
+        } else if (score >= beta) {
+            s->fails_high++;
+            beta = MIN(score + window, INFINITE_SCORE);
         } else {
-            n->score = MIN(n->score, child->score);
-            if (n->score == -1.0) break;
+            break;
         }
+        window *= 2;
     }
 
-    destroy_list_of_moves(moves, num_moves);
+    s->best_move = move;
+    s->best_score = score;
+    s->depth_reached = depth;
+
+    int i = 0;
+    while (s->order[i] != move) i++;
+    for (; i > 0; i--) s->order[i] = s->order[i - 1];
+    s->order[0] = move;
+
+    return true;
 }
 
-Move *minimax(Game *g) {
-    Node *root = create_node(g, NULL, NULL);
+/*
+ * Lazy SMP helper: deepens on its own until the main thread stops it. Its
+ * results reach the main thread through the transposition table; every
+ * other helper searches one move deeper than the main thread, so that the
+ * threads spread over different parts of the tree.
+ */
+static void *run_helper(void *arg) {
+    Search *s = (Search *)arg;
+    for (int depth = 1 + s->id % 2; depth <= MINIMAX_MAX_DEPTH; depth++)
+        if (!iterate(s, depth) || !s->depth_limited) break;
+
+    return NULL;
+}
 
-    simulate(root, true);
+static int get_num_threads() {
+#if MINIMAX_THREADS > 0
+    return MINIMAX_THREADS;
+#else
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return num_cpus > 0 ? (int)num_cpus : 1;
+#endif
+}
 
-    Node *best_child = select_best_child(root, true);
+static void init_search(Search *s, int id, Game *g, Move **moves, int *order,
+                        int num_moves, atomic_bool *stop,
+                        struct timespec start) {
+    s->id = id;
+    s->start = start;
+    s->stop = stop;
+    s->positions = (Game **)malloc(sizeof(Game *));
+    s->positions[0] = copy_game_state(g);
+    s->num_positions = 1;
+
+    for (int ply = 0; ply <= MINIMAX_MAX_DEPTH; ply++)
+        s->killers[ply][0] = s->killers[ply][1] = -1;
+    for (int player = 0; player < 2; player++)
+        s->history[player] =
+            (int64_t *)calloc(get_num_move_ids(), sizeof(int64_t));
+
+    s->moves = moves;
+    s->num_moves = num_moves;
+    s->order = (int *)malloc(sizeof(int) * num_moves);
+    for (int i = 0; i < num_moves; i++) s->order[i] = order[i];
+    s->best_move = order[0];
+}
 
-    Move *best_move = copy_move(best_child->move);
+static void free_search(Search *s) {
+    free(s->order);
+    free(s->history[0]);
+    free(s->history[1]);
+    for (int i = 0; i < s->num_positions; i++) destroy_game(s->positions[i]);
+    free(s->positions);
+}
 
-    free_node(root);
+#if MINIMAX_THREAT_LENGTH > 0
+/*
+ * Looks for a forced win by threats, and returns its first move and score,
+ * or NULL if none was found.
+ */
+static Move *find_threat_win(Game *g, struct timespec start, int *score) {
+    Move *line[MINIMAX_THREAT_LENGTH];
+    int length = find_forced_win(g, true, MINIMAX_THREAT_LENGTH,
+                                 MINIMAX_TIME_LIMIT_MS / 10, line);
+    if (length == 0) return NULL;
+    *score = MINIMAX_REWARD_WIN - length;
+
+#if MINIMAX_REPORT
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    char report[512];
+    int n = snprintf(report, sizeof(report), "Forced win found in %.1f ms:",
+                     (now.tv_sec - start.tv_sec) * 1000.0 +
+                         (now.tv_nsec - start.tv_nsec) / 1000000.0);
+    for (int i = 0; i < length && n < (int)sizeof(report) - 1; i++) {
+        report[n++] = ' ';
+        format_move(line[i], report + n, sizeof(report) - n);
+        while (report[n] != '\0') n++;
+    }
+    print(report);
+#endif
+
+    for (int i = 1; i < length; i++) destroy_move(line[i]);
+    return line[0];
+}
+#endif
+
+/*
+ * Solves the position if the game can, and returns the move to play and its
+ * score, or NULL if it was not solved.
+ */
+static Move *solve_root(Game *g, struct timespec start, int *score) {
+    GameState result;
+    int length;
+    long long nodes;
+    Move *m = solve_position(g, &result, &length, &nodes);
+    if (m == NULL) return NULL;
+    *score = terminal_score(result, g->player_turn, length);
+
+#if MINIMAX_REPORT
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - start.tv_sec) * 1000.0 +
+                     (now.tv_nsec - start.tv_nsec) / 1000000.0;
+    char report[128];
+    snprintf(report, sizeof(report),
+             "Solved, score %d, %lld nodes in %.0f ms (%.0f nodes/s)", *score,
+             nodes, elapsed, elapsed > 0 ? nodes * 1000.0 / elapsed : 0.0);
+    print(report);
+#endif
+
+    return m;
+}
+
+/*
+ * Iterative deepening: searches one move deeper at a time, trying the best
+ * move of the previous depth first, until the time budget runs out, a win or
+ * loss is found or the whole game tree has been searched. An iteration that
+ * runs out of time is discarded, and one is only started within the first
+ * half of the budget, as it takes longer than all the previous ones. Helper
+ * threads search the same root at the same time (Lazy SMP), only speeding up
+ * the main thread through the table, and the main thread's move is played.
+ * Positions of the opening book, forced wins by threats and positions the
+ * game solves are answered without searching.
+ */
+Move *minimax_search(Game *g, int *score) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+#ifdef BOOK_FILE
+    Move *book_move = book_lookup(g, score);
+    if (book_move != NULL) {
+#if MINIMAX_REPORT
+        char report[64];
+        snprintf(report, sizeof(report), "Book move, score %d", *score);
+        print(report);
+#endif
+        return book_move;
+    }
+#endif
+#if MINIMAX_THREAT_LENGTH > 0
+    Move *threat_win = find_threat_win(g, start, score);
+    if (threat_win != NULL) return threat_win;
+#endif
+    Move *solved = solve_root(g, start, score);
+    if (solved != NULL) return solved;
+    init_table();
+    generation++;
+
+    int num_moves = 0;
+    Move **moves = get_possible_moves(g, &num_moves);
+    int *order = (int *)malloc(sizeof(int) * num_moves);
+    int *priors = (int *)malloc(sizeof(int) * num_moves);
+    for (int i = 0; i < num_moves; i++) {
+        // The first depth searches the root moves by decreasing prior
+        int prior = get_move_prior(g, moves[i]);
+        int j = i;
+        for (; j > 0 && priors[j - 1] < prior; j--) {
+            priors[j] = priors[j - 1];
+            order[j] = order[j - 1];
+        }
+        priors[j] = prior;
+        order[j] = i;
+    }
+    free(priors);
+
+    // The games set up their hash keys on first use, which must not happen
+    // in several threads at once
+    int symmetry;
+    hash_game_state(g);
+    hash_canonical_state(g, &symmetry);
+
+    atomic_bool stop = false;
+    int num_threads = num_moves > 1 ? get_num_threads() : 1;
+    Search *searches = (Search *)calloc(num_threads, sizeof(Search));
+    for (int i = 0; i < num_threads; i++)
+        init_search(&searches[i], i, g, moves, order, num_moves, &stop,
+                    start);
+
+    pthread_t *threads = (pthread_t *)malloc(sizeof(pthread_t) * num_threads);
+    int num_started = 1;
+    for (; num_started < num_threads; num_started++)
+        if (pthread_create(&threads[num_started], NULL, run_helper,
+                           &searches[num_started]) != 0)
+            break;
+
+    Search *s = &searches[0];
+    for (int depth = 1; num_moves > 1 && depth <= MINIMAX_MAX_DEPTH; depth++) {
+        if (!iterate(s, depth)) break;
+
+        if (!s->depth_limited || is_decisive(s->best_score) ||
+            elapsed_ms(s) >= MINIMAX_TIME_LIMIT_MS / 2)
+            break;
+    }
+
+    atomic_store(&stop, true);
+    for (int i = 1; i < num_started; i++) pthread_join(threads[i], NULL);
+    free(threads);
+
+    long long nodes = 0, quiescence_nodes = 0;
+    long long probes = 0, hits = 0, cutoffs = 0;
+    long long researches = 0, fails_high = 0, fails_low = 0;
+    for (int i = 0; i < num_started; i++) {
+        nodes += searches[i].nodes;
+        quiescence_nodes += searches[i].quiescence_nodes;
+        probes += searches[i].probes;
+        hits += searches[i].hits;
+        cutoffs += searches[i].cutoffs;
+        researches += searches[i].researches;
+        fails_high += searches[i].fails_high;
+        fails_low += searches[i].fails_low;
+    }
+
+#if MINIMAX_REPORT
+    double elapsed = elapsed_ms(s);
+    char report[256];
+    snprintf(report, sizeof(report),
+             "Depth %d, score %d, %lld nodes (%.0f%% quiescence) in %.0f ms "
+             "(%.0f nodes/s) on %d threads, table hits %.0f%%, cutoffs "
+             "%.0f%%, %lld re-searches, window fails %lld high %lld low",
+             s->depth_reached, s->best_score, nodes,
+             nodes > 0 ? 100.0 * quiescence_nodes / nodes : 0.0, elapsed,
+             elapsed > 0 ? nodes * 1000.0 / elapsed : 0.0, num_started,
+             probes > 0 ? 100.0 * hits / probes : 0.0,
+             probes > 0 ? 100.0 * cutoffs / probes : 0.0, researches,
+             fails_high, fails_low);
+    print(report);
+#endif
+
+    Move *best_move = copy_move(moves[s->best_move]);
+    *score = s->best_score;
+
+    for (int i = 0; i < num_threads; i++) free_search(&searches[i]);
+    free(searches);
+    free(order);
+    destroy_list_of_moves(moves, num_moves);
 
     return best_move;
 }
 
+Move *minimax(Game *g) {
+    int score;
+    return minimax_search(g, &score);
+}
+
 Move *ai_make_move(Game *g) {
     return minimax(g);
-}
+}
\ No newline at end of file
@@ -1,12 +1,135 @@
 #ifndef _MINIMAX_H
 #define _MINIMAX_H
 
+#include <stddef.h>
+
 #include "game.h"
 
 #define MINIMAX_REWARD_WIN 10000
 #define MINIMAX_REWARD_DRAW 0
 #define MINIMAX_REWARD_LOSE -10000
 
+/**
+ * Time budget of one move in milliseconds, by default the MOVE_TIME_LIMIT of
+ * the MCTS engine. Iterative deepening plays the best move of the last depth
+ * it completed within it.
+ */
+#ifndef MINIMAX_TIME_LIMIT_MS
+#define MINIMAX_TIME_LIMIT_MS (MOVE_TIME_LIMIT * 1000)
+#endif
+
+/**
+ * Deepest iteration, in moves. A win or loss found at ply n is scored
+ * MINIMAX_REWARD_WIN - n or MINIMAX_REWARD_LOSE + n, so that faster wins and
+ * slower losses are preferred.
+ */
+#ifndef MINIMAX_MAX_DEPTH
+#define MINIMAX_MAX_DEPTH 64
+#endif
+
+/**
+ * Prints the depth reached, the score and the nodes searched per second
+ * after every move.
+ */
+#ifndef MINIMAX_REPORT
+#define MINIMAX_REPORT 1
+#endif
+
+/**
+ * Default number of transposition table entries, a power of two, each of 16
+ * bytes, which the MINIMAX_TABLE_SIZE environment variable overrides at
+ * runtime. The table is kept from one move to the next. Positions are stored
+ * in buckets of two entries, one kept for the deepest search of the bucket
+ * and one for the latest. 0 disables the table.
+ */
+#ifndef MINIMAX_TABLE_SIZE
+#define MINIMAX_TABLE_SIZE (1 << 20)
+#endif
+
+/**
+ * Longest sequence of captures (get_capture_moves) searched beyond the depth
+ * limit, so that positions in the middle of an exchange are not evaluated:
+ * at each position of the sequence the player to move may capture or stand
+ * on the static evaluation. 0 evaluates every position at the depth limit.
+ */
+#ifndef MINIMAX_QUIESCENCE_DEPTH
+#define MINIMAX_QUIESCENCE_DEPTH 16
+#endif
+
+/**
+ * Positions that a symmetry of the board maps onto each other share their
+ * transposition table entries, found by hash_canonical_state(), the best move
+ * being stored as it is in the canonical position.
+ */
+#ifndef MINIMAX_SYMMETRIES
+#define MINIMAX_SYMMETRIES 1
+#endif
+
+/**
+ * Principal variation search: moves after the first of each position are
+ * searched with a null window, and only searched again with the full one
+ * when they turn out better.
+ */
+#ifndef MINIMAX_PVS
+#define MINIMAX_PVS 1
+#endif
+
+/**
+ * Half width of the aspiration window around the score of the previous
+ * iteration that each iteration is first searched with, on the scale of
+ * EVALUATION_SCALE. 0 searches every iteration with a full window.
+ */
+#ifndef MINIMAX_ASPIRATION_WINDOW
+#define MINIMAX_ASPIRATION_WINDOW (EVALUATION_SCALE / 2)
+#endif
+
+/**
+ * Number of threads searching each move, sharing the transposition table.
+ * 0 uses one per online CPU.
+ */
+#ifndef MINIMAX_THREADS
+#define MINIMAX_THREADS 0
+#endif
+
+/**
+ * Longest forced win, in moves of both players, that a threat-space search
+ * (find_forced_win) looks for before each search, within a tenth of the
+ * time budget. A win found is played without searching. 0 skips it.
+ */
+#ifndef MINIMAX_THREAT_LENGTH
+#define MINIMAX_THREAT_LENGTH 25
+#endif
+
+/**
+ * Longest forced win by threats to win on the next move looked for at the
+ * depth limit, where a win found is scored as one instead of evaluated.
+ * 0 skips it.
+ */
+#ifndef MINIMAX_LEAF_THREAT_LENGTH
+#define MINIMAX_LEAF_THREAT_LENGTH 0
+#endif
+
 Move *minimax(Game *g);
 
+/**
+ * Chooses a move like minimax(), also giving its score.
+ *
+ * @param g Pointer to the game structure.
+ * @param score Filled with the score of the move for the player to move, a
+ * win or loss in n moves scoring MINIMAX_REWARD_WIN - n or
+ * MINIMAX_REWARD_LOSE + n.
+ * @return Move* Move to play.
+ */
+Move *minimax_search(Game *g, int *score);
+
+/**
+ * Changes the number of transposition table entries at runtime, clearing the
+ * table. The size is rounded down to a power of two, and 0 disables it. The
+ * MINIMAX_TABLE_SIZE environment variable is applied through it before the
+ * first search.
+ *
+ * @param num_entries Number of entries.
+ */
+void minimax_set_table_size(size_t num_entries);
+
 #endif
\ No newline at end of file
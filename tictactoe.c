@@ -1,8 +1,10 @@
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+#include "ai.h"
 #include "game.h"
 
 typedef struct Move {
@@ -69,6 +71,12 @@ Game *copy_game_state(Game *g) {
     return copy;
 }
 
+void copy_game_state_into(Game *dst, Game *src) {
+    dst->player_turn = src->player_turn;
+    dst->result = src->result;
+    memcpy(dst->board, src->board, 10);
+}
+
 Move *copy_move(Move *m) {
     if (!m) return NULL;
 
@@ -198,6 +206,134 @@ void destroy_list_of_moves(Move **moves, int num_moves) {
     free(moves);
 }
 
+Move **get_rollout_moves(Game *g, int *num_moves) {
+    return get_possible_moves(g, num_moves);
+}
+
+Move **get_capture_moves(Game *g, int *num_moves) {
+    // Nothing is captured in tic-tac-toe
+    *num_moves = 0;
+    return NULL;
+}
+
+/** Zobrist keys of X and O on each cell, and of O to move. */
+static uint64_t hash_keys[9][2], turn_key;
+
+/** Cell that each symmetry of the board maps each cell to. */
+static unsigned char symmetric_cells[SQUARE_SYMMETRIES][9];
+
+/*
+ * Sets up the Zobrist keys and the cells of the symmetries the first time a
+ * position is hashed.
+ */
+static void init_hash_keys() {
+    static bool initialized = false;
+    if (initialized) return;
+    initialized = true;
+
+    uint64_t seed = 9;
+    fill_hash_keys(&hash_keys[0][0], 9 * 2, &seed);
+    fill_hash_keys(&turn_key, 1, &seed);
+    fill_square_symmetries(&symmetric_cells[0][0], 3);
+}
+
+uint64_t hash_game_state(Game *g) {
+    init_hash_keys();
+
+    char *board = (char *)g->board;
+    uint64_t hash = g->player_turn == PLAYER2 ? turn_key : 0;
+
+    for (int i = 0; i < 9; i++) {
+        if (board[i] != '\0') hash ^= hash_keys[i][board[i] == 'X' ? 0 : 1];
+    }
+
+    return hash;
+}
+
+uint64_t hash_canonical_state(Game *g, int *symmetry) {
+    init_hash_keys();
+
+    // The hashes of all the symmetric positions are made in one pass
+    char *board = (char *)g->board;
+    uint64_t hashes[SQUARE_SYMMETRIES] = {0};
+    for (int i = 0; i < 9; i++) {
+        if (board[i] == '\0') continue;
+
+        int p = board[i] == 'X' ? 0 : 1;
+        for (int s = 0; s < SQUARE_SYMMETRIES; s++)
+            hashes[s] ^= hash_keys[symmetric_cells[s][i]][p];
+    }
+
+    *symmetry = 0;
+    for (int s = 1; s < SQUARE_SYMMETRIES; s++) {
+        if (hashes[s] < hashes[*symmetry]) *symmetry = s;
+    }
+
+    return hashes[*symmetry] ^ (g->player_turn == PLAYER2 ? turn_key : 0);
+}
+
+int transform_move_id(int move_id, int symmetry, bool inverse) {
+    if (inverse) symmetry = invert_square_symmetry(symmetry);
+    return symmetric_cells[symmetry][move_id];
+}
+
+int get_move_id(Move *m) {
+    return (m->r - 1) * 3 + (m->c - 1);
+}
+
+int get_num_move_ids() {
+    return 9;
+}
+
+int get_move_prior(Game *g, Move *m) {
+    // Number of lines through the cell: 4 for the centre, 3 for corners
+    if (m->r == 2 && m->c == 2) return 4;
+    return m->r != 2 && m->c != 2 ? 3 : 2;
+}
+
+int evaluate(Game *g) {
+    static const int lines[8][3] = {{0, 1, 2}, {3, 4, 5}, {6, 7, 8},
+                                    {0, 3, 6}, {1, 4, 7}, {2, 5, 8},
+                                    {0, 4, 8}, {2, 4, 6}};
+    char *board = (char *)g->board;
+    char symbol = g->player_turn == PLAYER1 ? 'X' : 'O';
+    int score = 0;
+
+    // Lines still open to only one player, weighted by their marks
+    for (int i = 0; i < 8; i++) {
+        int own = 0, opponent = 0;
+        for (int j = 0; j < 3; j++) {
+            char cell = board[lines[i][j]];
+            if (cell == symbol)
+                own++;
+            else if (cell != '\0')
+                opponent++;
+        }
+
+        if (opponent == 0) score += own * own * 10;
+        if (own == 0) score -= opponent * opponent * 10;
+    }
+
+    return score;
+}
+
+int find_forced_win(Game *g, bool threes, int max_length, int time_limit_ms,
+                    Move **line) {
+    // A full search sees to the end of the game from any position
+    return 0;
+}
+
+Move *solve_position(Game *g, GameState *result, int *length,
+                     long long *nodes) {
+    // The search solves every position already
+    return NULL;
+}
+
+bool probe_endgame(Game *g, GameState *result, int *length) {
+    // No endgame databases for tic-tac-toe
+    return false;
+}
+
 GameState evaluate_game_state(Game *g) {
     char *board = g->board;
 
@@ -294,6 +430,10 @@ void print_move(Game *g, Move *m) {
     printf("(%d, %d)\n\n", m->r, m->c);
 }
 
+void format_move(Move *m, char *str, int size) {
+    snprintf(str, size, "%d,%d", m->r, m->c);
+}
+
 void print(char *str) {
     printf("%s\n", str);
 }